@@ -0,0 +1,308 @@
+// corpus.cpp : This is the corpus.exe tool. It writes a deterministic synthetic
+// input for plex, a bench.cc plus a catalog, to benchmark the whole pipeline
+// with src\data\bench_harness.bat. It is not part of plex.exe.
+//
+// usage: corpus.exe <dir> [--mb=<size>] [--depth=<n>] [--comments=<%>]
+//                         [--raw=<%>] [--fanout=<n>] [--seed=<n>]
+
+#include <SDKDDKVer.h>
+
+#include <stdio.h>
+#include <Windows.h>
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// Thrown when a file or a directory of the corpus can't be created.
+class CorpusException {
+  std::wstring path_;
+
+public:
+  explicit CorpusException(const std::wstring& path) : path_(path) {
+  }
+
+  const wchar_t* Path() const { return path_.c_str(); }
+};
+
+// Knobs of the synthetic benchmark corpus, see CorpusGenerator.
+struct CorpusOptions {
+  size_t megabytes;   // Approximate size of bench.cc plus the catalog.
+  int depth;          // Maximum nesting of namespaces and blocks.
+  int comments;       // Percent of statements preceded by a comment.
+  int raw_strings;    // Percent of string literals that are c++11 raw strings.
+  int fanout;         // Dependencies of each catalog entity.
+  uint32_t seed;
+
+  CorpusOptions()
+      : megabytes(1), depth(4), comments(20), raw_strings(5), fanout(4), seed(1) {
+  }
+};
+
+// Buffered writes to a new file, which keep count of the bytes written.
+class CorpusFile {
+  FILE* file_;
+  std::wstring path_;
+  std::string buf_;
+  uint64_t flushed_;
+
+  static const size_t kBufferSize = 1024 * 1024;
+
+public:
+  explicit CorpusFile(const std::wstring& path)
+      : file_(nullptr), path_(path), flushed_(0) {
+    if (_wfopen_s(&file_, path.c_str(), L"wb") != 0)
+      throw CorpusException(path);
+    buf_.reserve(kBufferSize);
+  }
+
+  ~CorpusFile() {
+    fclose(file_);
+  }
+
+  void Append(const std::string& text) {
+    buf_ += text;
+    if (buf_.size() >= kBufferSize)
+      Flush();
+  }
+
+  void Flush() {
+    if (fwrite(buf_.data(), 1, buf_.size(), file_) != buf_.size())
+      throw CorpusException(path_);
+    flushed_ += buf_.size();
+    buf_.clear();
+  }
+
+  uint64_t BytesWritten() const {
+    return flushed_ + buf_.size();
+  }
+
+private:
+  CorpusFile(const CorpusFile&);
+  CorpusFile& operator=(const CorpusFile&);
+};
+
+// Writes a deterministic synthetic corpus to benchmark the whole pipeline:
+// |dir|\bench.cc and a catalog in |dir|\catalog with an index.plex and a
+// header per entity. The catalog has four layers of 2 * fanout entities; each
+// entity uses |fanout| entities of the layer below and bench.cc uses the top
+// layer. The catalog gets about a tenth of the bytes. The same options always
+// produce the same files.
+class CorpusGenerator {
+  const CorpusOptions& opts_;
+  uint64_t state_;
+  int next_fn_;
+
+  static const int kLayers = 4;
+
+public:
+  explicit CorpusGenerator(const CorpusOptions& opts)
+      : opts_(opts), state_(0x9e3779b97f4a7c15ULL ^ opts.seed), next_fn_(0) {
+  }
+
+  // Returns the number of bytes written.
+  uint64_t Generate(const std::wstring& dir) {
+    MakeDirectory(dir);
+    auto catalog = dir + L"\\catalog";
+    MakeDirectory(catalog);
+    MakeDirectory(catalog + L"\\bx");
+
+    const int per_layer = 2 * std::max(opts_.fanout, 1);
+    const int entities = kLayers * per_layer;
+    const uint64_t total = static_cast<uint64_t>(opts_.megabytes) * 1024 * 1024;
+    const uint64_t entity_size = std::max<uint64_t>(total / 10 / entities, 512);
+
+    uint64_t written = 0;
+    std::string index("// #index.plex [synthetic corpus].\n\ninclude 1 {\n"
+                      "  std::string <string>;\n  std::vector <vector>;\n}\n\ncatalog 1 {\n");
+    for (int ix = 0; ix != entities; ++ix) {
+      auto name = "Gen" + std::to_string(ix);
+      index += "  bx::" + name + " bx\\" + name + ".h;\n";
+
+      CorpusFile out(catalog + L"\\bx\\" + std::wstring(name.begin(), name.end()) + L".h");
+      std::vector<std::string> deps;
+      if (ix < per_layer) {
+        deps.push_back("std::string");
+      } else {
+        int below = (ix / per_layer - 1) * per_layer;
+        for (int d = 0; d != opts_.fanout; ++d)
+          deps.push_back("bx::Gen" + std::to_string(below + Pick(per_layer)));
+      }
+      WriteEntity(out, name, deps, entity_size);
+      out.Flush();
+      written += out.BytesWritten();
+    }
+    index += "}\n";
+    CorpusFile index_file(catalog + L"\\index.plex");
+    index_file.Append(index);
+    index_file.Flush();
+    written += index.size();
+
+    std::vector<std::string> top;
+    for (int ix = entities - per_layer; ix != entities; ++ix)
+      top.push_back("bx::Gen" + std::to_string(ix));
+
+    CorpusFile out(dir + L"\\bench.cc");
+    out.Append("// Synthetic plex benchmark input.\n\n");
+    const uint64_t cc_size = (total > written) ? total - written : 4096;
+    while (out.BytesWritten() < cc_size) {
+      int nesting = 1 + Pick(std::max(opts_.depth, 1));
+      for (int n = 0; n != nesting; ++n)
+        out.Append("namespace n" + std::to_string(Pick(16)) + " {\n");
+      for (int f = 0; f != 8; ++f)
+        WriteFunction(out, top, nesting);
+      for (int n = 0; n != nesting; ++n)
+        out.Append("}\n");
+      out.Append("\n");
+    }
+    out.Append("int wmain(int argc, wchar_t* argv[]) {\n  return 0;\n}\n");
+    out.Flush();
+    return written + out.BytesWritten();
+  }
+
+private:
+  // xorshift64*.
+  uint64_t Next() {
+    state_ ^= state_ >> 12;
+    state_ ^= state_ << 25;
+    state_ ^= state_ >> 27;
+    return state_ * 2685821657736338717ULL;
+  }
+
+  int Pick(int n) {
+    return static_cast<int>(Next() % static_cast<uint64_t>(n));
+  }
+
+  bool Chance(int percent) {
+    return Pick(100) < percent;
+  }
+
+  static std::string ToHex(uint64_t value) {
+    std::ostringstream oss;
+    oss << std::hex << std::setw(16) << std::setfill('0') << value;
+    return oss.str();
+  }
+
+  static void MakeDirectory(const std::wstring& dir) {
+    if (!::CreateDirectoryW(dir.c_str(), NULL)) {
+      if (::GetLastError() != ERROR_ALREADY_EXISTS)
+        throw CorpusException(dir);
+    }
+  }
+
+  void WriteEntity(CorpusFile& out, const std::string& name,
+                   const std::vector<std::string>& deps, uint64_t size) {
+    out.Append("//#~def bx::" + name + "\n// Synthetic catalog entity.\nnamespace bx {\n");
+    out.Append("class " + name + " {\n  int v_;\n\npublic:\n");
+    out.Append("  " + name + "(int v) : v_(v) {}\n\n");
+    int steps = 0;
+    do {
+      out.Append("  int Step" + std::to_string(steps++) + "(int a) {\n");
+      WriteStatements(out, 2, 2);
+      out.Append("    return a;\n  }\n\n");
+    } while (out.BytesWritten() < size);
+    out.Append("  int Run(int a) {\n");
+    for (size_t ix = 0; ix != deps.size(); ++ix)
+      out.Append("    " + deps[ix] + " d" + std::to_string(ix) + "(a);\n");
+    for (int ix = 0; ix != steps; ++ix)
+      out.Append("    a += Step" + std::to_string(ix) + "(a);\n");
+    out.Append("    return a + v_;\n  }\n");
+    out.Append("};\n}\n");
+  }
+
+  void WriteFunction(CorpusFile& out, const std::vector<std::string>& top, int nesting) {
+    int id = next_fn_++;
+    if (Chance(opts_.comments))
+      out.Append("// Function " + std::to_string(id) + " of the synthetic corpus.\n");
+    out.Append("int fn_" + std::to_string(id) + "(int a, const char* s) {\n");
+    if (Chance(25))
+      out.Append("  " + top[Pick(static_cast<int>(top.size()))] + " e(a);\n");
+    WriteStatements(out, 1, std::max(opts_.depth - nesting, 1));
+    if (id && Chance(50))
+      out.Append("  a += fn_" + std::to_string(id - 1) + "(a, s);\n");
+    out.Append("  return a;\n}\n\n");
+  }
+
+  void WriteStatements(CorpusFile& out, int indent, int depth) {
+    const std::string pad(indent * 2, ' ');
+    const int count = 2 + Pick(5);
+    for (int ix = 0; ix != count; ++ix) {
+      if (Chance(opts_.comments))
+        out.Append(pad + "// Adjusts the running value, step " + std::to_string(ix) + ".\n");
+      switch (Pick(5)) {
+        case 0:
+          out.Append(pad + "a = (a * " + std::to_string(Pick(1000)) + ") ^ 0x" +
+                     ToHex(Next()).substr(0, 4) + ";\n");
+          break;
+        case 1:
+          if (Chance(opts_.raw_strings))
+            out.Append(pad + "s = R\"(raw \"text\" [" + std::to_string(Pick(100)) + "] end)\";\n");
+          else
+            out.Append(pad + "s = \"text \\\"" + std::to_string(Pick(100)) + "\\\" end\";\n");
+          break;
+        case 2:
+          out.Append(pad + "a += static_cast<int>(" + std::to_string(Pick(100)) + ".5f * 'x');\n");
+          break;
+        default:
+          if (depth > 1) {
+            out.Append(pad + "if (a > " + std::to_string(Pick(64)) + ") {\n");
+            WriteStatements(out, indent + 1, depth - 1);
+            out.Append(pad + "}\n");
+          } else {
+            out.Append(pad + "a -= " + std::to_string(Pick(7)) + ";\n");
+          }
+          break;
+      }
+    }
+  }
+};
+
+int wmain(int argc, wchar_t* argv[]) {
+  CorpusOptions opts;
+  std::wstring dir;
+  for (int ix = 1; ix != argc; ++ix) {
+    std::wstring arg(argv[ix]);
+    if (arg.compare(0, 2, L"--") != 0) {
+      dir = arg;
+      continue;
+    }
+    auto eq = arg.find(L'=');
+    auto name = arg.substr(2, eq - 2);
+    int value = (eq == std::wstring::npos) ? 0 : _wtoi(arg.c_str() + eq + 1);
+    if (name == L"mb")
+      opts.megabytes = value;
+    else if (name == L"depth")
+      opts.depth = value;
+    else if (name == L"comments")
+      opts.comments = value;
+    else if (name == L"raw")
+      opts.raw_strings = value;
+    else if (name == L"fanout")
+      opts.fanout = value;
+    else if (name == L"seed")
+      opts.seed = value;
+    else {
+      wprintf(L"error: unknown option [%s]\n", arg.c_str());
+      return 1;
+    }
+  }
+
+  if (dir.empty()) {
+    wprintf(L"usage: corpus.exe <dir> [--mb=<size>] [--depth=<n>] [--comments=<%%>]\n");
+    wprintf(L"                        [--raw=<%%>] [--fanout=<n>] [--seed=<n>]\n");
+    return 1;
+  }
+
+  try {
+    auto bytes = CorpusGenerator(opts).Generate(dir);
+    wprintf(L"corpus: [%s] %llu bytes\n", dir.c_str(), bytes);
+    return 0;
+  } catch (CorpusException& ex) {
+    wprintf(L"error: can't create file [%s]\n", ex.Path());
+    return 2;
+  }
+}
@@ -0,0 +1,53 @@
+@echo off
+echo == plex benchmark harness v1 ==
+
+REM usage: bench_harness.bat <Debug|Release> [max corpus MB, default 256]
+set plexbin="..\plex\out\x64\%1\plex.exe"
+if not exist %plexbin% goto error1
+set corpusbin="..\plex\out\x64\%1\corpus.exe"
+if not exist %corpusbin% goto error1
+
+set /a maxmb=256
+if not "%2"=="" set /a maxmb=%2
+
+if not exist bench mkdir bench
+if not exist bench\results mkdir bench\results
+setlocal ENABLEDELAYEDEXPANSION
+
+REM size scaling, default corpus knobs.
+for %%s in (1 4 16 64 256 1024) do (
+  if %%s LEQ !maxmb! (
+    echo corpus %%s MB
+    %corpusbin% bench\size_%%s --mb=%%s
+    if errorlevel 1 goto error2
+    %plexbin% --generate --stats=json --out-dir=bench\size_%%s\out bench\size_%%s\bench.cc > bench\results\size_%%s.json
+    if errorlevel 1 goto error2
+  )
+)
+
+REM corpus shape at 16 MB: nesting, comment density, raw strings and catalog fan-out.
+for %%p in (depth:1 depth:8 comments:0 comments:60 raw:0 raw:50 fanout:1 fanout:16) do (
+  for /F "tokens=1,2 delims=:" %%a in ("%%p") do (
+    echo corpus 16 MB %%a=%%b
+    %corpusbin% bench\%%a_%%b --mb=16 --%%a=%%b
+    if errorlevel 1 goto error2
+    %plexbin% --generate --stats=json --out-dir=bench\%%a_%%b\out bench\%%a_%%b\bench.cc > bench\results\%%a_%%b.json
+    if errorlevel 1 goto error2
+  )
+)
+
+echo results in bench\results
+goto end
+
+:error1
+echo no plex or corpus binary found
+echo %plexbin% %corpusbin%
+goto end
+
+:error2
+echo plex failed.
+goto end
+
+:end
+echo == plex benchmark harness end ==
+endlocal
@@ -8,12 +8,16 @@ set /a errcount=0
 set /a count=0
 setlocal ENABLEDELAYEDEXPANSION
 
+if exist gen_inputs.txt del gen_inputs.txt
 for /F %%x in ('dir /B/D *.cc') do (
   echo processing %%x
   set /a count=count+1
-  %plexbin% --dump-tree --out-dir=gen %%x
-  if errorlevel 1 set /a errcount=errcount+1
+  echo %%x>> gen_inputs.txt
 )
+REM one batch run shares the catalog between all the inputs.
+%plexbin% --dump-tree --out-dir=gen @gen_inputs.txt
+if errorlevel 1 set /a errcount=errcount+1
+del gen_inputs.txt
 echo .
 echo !count! files processed.
 echo .
@@ -31,6 +35,21 @@ echo !count! files compared.
 echo .
 if !errcount! NEQ 0 goto error2
 
+set /a errcount=0
+set /a count=0
+
+REM one input at the time, tokenized in small chunks on several threads.
+for /F %%x in ('dir /B/D *.cc') do (
+  set /a count=count+1
+  %plexbin% --dump-tree --out-dir=gen_chunks --jobs=4 --tokenize-chunk=64 %%x
+  if errorlevel 1 set /a errcount=errcount+1
+  FC reference\%%x.dmp gen_chunks\%%x.dmp
+  if errorlevel 1 set /a errcount=errcount+1
+)
+echo !count! files compared with chunked tokenization.
+echo .
+if !errcount! NEQ 0 goto error2
+
 echo no errors found.
 goto end
 
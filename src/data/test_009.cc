@@ -0,0 +1,29 @@
+// test_009, part of the plex test suite.
+#pragma comment(user, "plex.define=plex_test")
+
+// The "#if 0" line in this raw string makes plex tokenize the file again
+// without skipping the #if 0 regions.
+const char* disabled = R"(
+#if 0
+#endif
+)";
+
+#if 0 // not built.
+int dropped_zero;
+#endif
+
+#if 1 // always built.
+int kept_one;
+#else
+int dropped_one;
+#endif
+
+#ifdef plex_test // set above.
+int kept_two;
+#else
+int dropped_two;
+#endif
+
+#ifndef plex_test // set above.
+int dropped_three;
+#endif
@@ -78,6 +78,9 @@
 #include <stdio.h>
 #include <tchar.h>
 #include <Windows.h>
+#include <Psapi.h>
+#include <Sddl.h>
+#include <emmintrin.h>
 
 #include <stdlib.h>
 #include <algorithm>
@@ -87,14 +90,25 @@
 #include <set>
 #include <iomanip>
 #include <iterator>
+#include <map>
 #include <vector>
 #include <unordered_map>
+#include <unordered_set>
 #include <memory>
 #include <functional>
 #include <type_traits>
 #include <utility>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <mutex>
+#include <thread>
+
+#pragma comment(lib, "psapi.lib")
+#pragma comment(lib, "advapi32.lib")
 
 #pragma region constants
+const char plex_version[] = "0.4";
 const char anonymous_namespace_mk[] = "<[anonymous]>";
 const char scope_namespace_mk[] = "<[scope]>";
 char first_include_key[] = "!~";
@@ -126,16 +140,20 @@ public:
 class IOException : public PlexException {
   DWORD error_code_;
   const std::wstring name_;
+  const char* action_;
 
 public:
-  IOException(int line, const wchar_t* name)
+  // |action| is what failed on |name|: "open", "read" or "write".
+  IOException(int line, const wchar_t* name, const char* action = "open")
       : PlexException(line, "IO problem"),
         error_code_(::GetLastError()),
-        name_(name) {
+        name_(name),
+        action_(action) {
     PostCtor();
   }
   DWORD ErrorCode() const { return error_code_; }
   const wchar_t* Name() const { return name_.c_str(); }
+  const char* Action() const { return action_; }
 };
 
 class TokenizerException : public PlexException {
@@ -151,6 +169,17 @@ public:
   const wchar_t* Path() const { return file_.c_str(); }
 };
 
+class DependencyException : public PlexException {
+  std::string cycle_;
+
+public:
+  DependencyException(int line, const std::string& cycle)
+      : PlexException(line, "dependency conflict"), cycle_(cycle) {
+    PostCtor();
+  }
+  const char* Cycle() const { return cycle_.c_str(); }
+};
+
 class CatalogException : public PlexException {
   int source_line_;
 
@@ -337,6 +366,124 @@ int DecodeUTF8Point(char*& start, const Range<char>& range) {
   return -1;
 }
 
+// Bump allocator for the objects that live as long as a run: the KeyElements,
+// the Inserts, the catalog token vectors, the xentities and the strings that
+// back synthesized tokens. Objects are placed in 64 KB blocks and destroyed in
+// bulk, in reverse order of creation, by Release(). New() is thread-safe.
+class Arena {
+public:
+  struct Stats {
+    size_t objects;
+    size_t bytes;
+    size_t blocks;
+    size_t releases;
+  };
+
+  static const size_t kBlockSize = 64 * 1024;
+
+  Arena() : blocks_(nullptr), dtors_(nullptr), cursor_(nullptr), limit_(nullptr) {
+    memset(&stats_, 0, sizeof(stats_));
+  }
+
+  ~Arena() {
+    Release();
+  }
+
+  template <typename T, typename... Args>
+  T* New(Args&&... args) {
+    std::lock_guard<std::mutex> lock(lock_);
+    if (std::is_trivially_destructible<T>::value) {
+      auto mem = Allocate(sizeof(T), std::alignment_of<T>::value);
+      return new (mem) T(std::forward<Args>(args)...);
+    }
+    auto mem = Allocate(sizeof(Holder<T>), std::alignment_of<Holder<T>>::value);
+    auto holder = new (mem) Holder<T>(std::forward<Args>(args)...);
+    holder->next = dtors_;
+    dtors_ = holder;
+    return &holder->obj;
+  }
+
+  // Destroys every object and frees every block.
+  void Release() {
+    std::lock_guard<std::mutex> lock(lock_);
+    while (dtors_) {
+      auto next = dtors_->next;
+      dtors_->destroy(dtors_);
+      dtors_ = next;
+    }
+    while (blocks_) {
+      auto next = blocks_->next;
+      ::operator delete(blocks_);
+      blocks_ = next;
+    }
+    cursor_ = nullptr;
+    limit_ = nullptr;
+    ++stats_.releases;
+  }
+
+  // Totals since the arena was created.
+  Stats GetStats() {
+    std::lock_guard<std::mutex> lock(lock_);
+    return stats_;
+  }
+
+private:
+  struct Block {
+    Block* next;
+  };
+
+  struct Dtor {
+    Dtor* next;
+    void (*destroy)(Dtor*);
+  };
+
+  template <typename T>
+  struct Holder : public Dtor {
+    T obj;
+
+    template <typename... Args>
+    Holder(Args&&... args) : obj(std::forward<Args>(args)...) {
+      destroy = &Destroy;
+    }
+
+    static void Destroy(Dtor* dtor) {
+      static_cast<Holder*>(dtor)->~Holder();
+    }
+  };
+
+  void* Allocate(size_t size, size_t align) {
+    auto p = (reinterpret_cast<uintptr_t>(cursor_) + align - 1) & ~(align - 1);
+    if (!cursor_ || (p + size > reinterpret_cast<uintptr_t>(limit_))) {
+      size_t block_size = std::max(kBlockSize, sizeof(Block) + size + align);
+      auto block = static_cast<Block*>(::operator new(block_size));
+      block->next = blocks_;
+      blocks_ = block;
+      cursor_ = reinterpret_cast<char*>(block + 1);
+      limit_ = reinterpret_cast<char*>(block) + block_size;
+      p = (reinterpret_cast<uintptr_t>(cursor_) + align - 1) & ~(align - 1);
+      ++stats_.blocks;
+    }
+    cursor_ = reinterpret_cast<char*>(p + size);
+    ++stats_.objects;
+    stats_.bytes += size;
+    return reinterpret_cast<void*>(p);
+  }
+
+  Block* blocks_;
+  Dtor* dtors_;
+  char* cursor_;
+  char* limit_;
+  Stats stats_;
+  std::mutex lock_;
+};
+
+// The arena for the current run. It is never destroyed; the process exit
+// frees it.
+Arena& RunArena() {
+  static Arena* arena = new Arena;
+  return *arena;
+}
+
 #pragma endregion
 
 #pragma region cmdline
@@ -628,6 +775,14 @@ public:
     return li.QuadPart;
   }
 
+  // In 100ns units, like FILETIME.
+  uint64_t LastWriteTime() {
+    FILETIME write_time;
+    if (!::GetFileTime(handle_, nullptr, nullptr, &write_time))
+      throw IOException(__LINE__, nullptr);
+    return (static_cast<uint64_t>(write_time.dwHighDateTime) << 32) | write_time.dwLowDateTime;
+  }
+
   unsigned int Status() const {
     return status_;
   }
@@ -714,6 +869,13 @@ public:
     return FileView(map, start, start + file.SizeInBytes());
   }
 
+  FileView(FileView&& other)
+    : Range(other),
+      map_(other.map_) {
+    other.map_ = 0;
+    other.Reset();
+  }
+
   size_t RegionSize() const {
     MEMORY_BASIC_INFORMATION mbi = {0};
     ::VirtualQuery(Start(), &mbi, sizeof(mbi));
@@ -739,6 +901,7 @@ public:
 
 class Logger {
   File file_;
+  std::mutex lock_;
   static Logger* instance;
 
 public:
@@ -754,43 +917,56 @@ public:
     if (!file_.IsValid()) {
       throw IOException(__LINE__, path.Raw());
     }
-    file_.Write("@ Plex genlog [0.4] " __DATE__ "\n");
+    file_.Write(FromString(std::string("@ Plex genlog [") + plex_version + "] " __DATE__ "\n"));
     instance = this;
   }
 
   ~Logger() {
-    file_.Write("@ Session end\n\n");
+    Write("@ Session end\n\n");
   }
 
   void AddFileInfoStart(const FilePath& file) {
     auto text = std::string("file [") + file.ToAscii() + "]\n";
-    file_.Write(FromString(text));
+    Write(text);
   }
 
   void ReportException(PlexException& ex) {
     auto text = std::string("exception type=plex [") + ex.Message() + "]\n";
-    file_.Write(FromString(text));
+    Write(text);
   }
 
   void AddExternDef(const Range<char>& def, int line_no) {
-    auto text = std::string("adding xdef [") + ToString(def) + "] " + LineNumber(line_no);
+    auto text = std::string("adding xdef [") + ToString(def) + "] ln " + std::to_string(line_no);
     text.append(1, '\n');
-    file_.Write(FromString(text));
+    Write(text);
   }
 
   void ProcessInclude(const Range<char>& include) {
     auto text = std::string("include target [") + ToString(include) + "]\n";
-    file_.Write(FromString(text));
+    Write(text);
   }
 
   void ProcessCode(const Range<char>& code_ref) {
     auto text = std::string("code target [") + ToString(code_ref) + "]\n";
-    file_.Write(FromString(text));
+    Write(text);
+  }
+
+  void AddArenaStats(const Arena::Stats& stats) {
+    auto text = std::string("arena objects=") + std::to_string(stats.objects) +
+                " bytes=" + std::to_string(stats.bytes) +
+                " blocks=" + std::to_string(stats.blocks) +
+                " releases=" + std::to_string(stats.releases) + "\n";
+    Write(text);
   }
 
   void ProcessSplitDecl(const Range<char>& name) {
     auto text = std::string("split target [") + ToString(name) + "]\n";
-    file_.Write(FromString(text));
+    Write(text);
+  }
+
+  void ProcessPrunedDef(const Range<char>& name) {
+    auto text = std::string("pruned target [") + ToString(name) + "]\n";
+    Write(text);
   }
 
 private:
@@ -798,45 +974,407 @@ private:
     return File::Create(path, FileParams::AppendSharedRead(), FileSecurity());
   }
 
-  const char* LineNumber(int line_no) {
-    static char buf[] = "ln 123456789012";
-    _itoa_s(line_no, &buf[3], 12, 10);
-    return buf;
+  // Units of a batch run log from several threads.
+  void Write(const std::string& text) {
+    std::lock_guard<std::mutex> lock(lock_);
+    file_.Write(FromString(text));
   }
 };
 
 Logger* Logger::instance = nullptr;
 
-// Loads an entire file into memory, keeping only one copy. Memory is kept
-// until program ends. Harcoded limit of 256 MB for all files.
-Range<char> LoadFileOnce(const FilePath& path) {
+// Guards LoadFileOnce() when catalog entities are loaded by worker threads.
+std::mutex load_file_lock;
+
+// Serializes the error reports of the units of a batch run.
+std::mutex report_lock;
+
+// Calls |fn| for each index in [0, count) using up to |jobs| threads. The first
+// exception, in index order, is rethrown on the calling thread.
+void ParallelFor(size_t count, int jobs, const std::function<void(size_t)>& fn) {
+  std::vector<std::exception_ptr> errors(count);
+  std::atomic<size_t> next(0);
+
+  auto worker = [&]() {
+    for (size_t ix = next++; ix < count; ix = next++) {
+      try {
+        fn(ix);
+      } catch (...) {
+        errors[ix] = std::current_exception();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  size_t n_threads = std::min(count, static_cast<size_t>(jobs));
+  for (size_t ix = 1; ix < n_threads; ++ix)
+    threads.push_back(std::thread(worker));
+  worker();
+  for (auto& t : threads)
+    t.join();
+
+  for (auto& e : errors) {
+    if (e)
+      std::rethrow_exception(e);
+  }
+}
+
+struct LoadedFile {
+  std::wstring path;
+  Range<char> contents;
+  long long id;
+
+  LoadedFile(const std::wstring& path, const Range<char>& contents, long long id = 0)
+      : path(path), contents(contents), id(id) {}
+};
+
+// Every file read by LoadFileOnce(), in load order.
+std::vector<LoadedFile>& LoadedFiles() {
+  static std::vector<LoadedFile> files;
+  return files;
+}
+
+// Keeps the files plex reads mapped in memory and hands out zero-copy ranges
+// over them. A file stays mapped while it is pinned by Acquire(); released files
+// stay mapped too, until the unpinned ones go over kUnpinnedBudget bytes and the
+// least recently used are unmapped. A released file that changed on disk is
+// mapped again by the next Acquire().
+//
+// Every range is followed by at least kPadding zero bytes so the tokenizer can
+// safely read past the end. The tail of the last page of a mapping is zero, but
+// when it is too short the file is copied into a padded buffer instead.
+class MappedFiles {
+public:
+  static const size_t kPadding = 64;
+  static const size_t kUnpinnedBudget = size_t(512) * 1024 * 1024;
+
+  static MappedFiles& Get() {
+    static MappedFiles instance;
+    return instance;
+  }
+
+  // Maps |path| and pins it. Returns false if the file can't be opened.
+  bool Acquire(const FilePath& path, Range<char>& range, long long& id) {
+    File file = File::Create(path, FileParams::ReadSharedRead(), FileSecurity());
+    if (!file.IsValid())
+      return false;
+    id = file.GetUniqueId();
+    const size_t size = file.SizeInBytes();
+    const uint64_t write_time = file.LastWriteTime();
+
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = entries_.find(id);
+    if ((it != end(entries_)) && !it->second->pins &&
+        ((it->second->range.Size() != size) || (it->second->write_time != write_time))) {
+      // Changed on disk since it was released; map it again.
+      unpinned_size_ -= it->second->range.Size();
+      entries_.erase(it);
+      it = end(entries_);
+    }
+    if (it != end(entries_)) {
+      auto& entry = *it->second;
+      if (!entry.pins++)
+        unpinned_size_ -= entry.range.Size();
+      entry.last_use = ++clock_;
+      range = entry.range;
+      return true;
+    }
+
+    std::unique_ptr<Entry> entry(new Entry);
+    entry->write_time = write_time;
+    if (size && (TailSlack(size) >= kPadding)) {
+      entry->view.reset(new FileView(FileView::Create(file, 0, 0, nullptr)));
+      entry->range = Range<char>(entry->view->Start(), entry->view->Start() + size);
+    } else {
+      entry->copy.reset(new char[size + kPadding]());
+      Range<char> r(entry->copy.get(), entry->copy.get() + size);
+      if (size && (file.Read(r, 0) != size))
+        throw IOException(__LINE__, path.Raw(), "read");
+      entry->range = r;
+    }
+    entry->pins = 1;
+    entry->last_use = ++clock_;
+    range = entry->range;
+    entries_[id] = std::move(entry);
+    return true;
+  }
+
+  void Release(long long id) {
+    std::lock_guard<std::mutex> lock(lock_);
+    auto it = entries_.find(id);
+    if ((it == end(entries_)) || !it->second->pins)
+      throw PlexException(__LINE__, "unbalanced file release");
+    if (--it->second->pins)
+      return;
+    unpinned_size_ += it->second->range.Size();
+
+    while (unpinned_size_ > kUnpinnedBudget) {
+      auto lru = end(entries_);
+      for (auto e = begin(entries_); e != end(entries_); ++e) {
+        if (e->second->pins)
+          continue;
+        if ((lru == end(entries_)) || (e->second->last_use < lru->second->last_use))
+          lru = e;
+      }
+      unpinned_size_ -= lru->second->range.Size();
+      entries_.erase(lru);
+    }
+  }
+
+private:
+  struct Entry {
+    std::unique_ptr<FileView> view;
+    std::unique_ptr<char[]> copy;
+    Range<char> range;
+    uint64_t write_time;
+    int pins;
+    uint64_t last_use;
+  };
+
+  std::unordered_map<long long, std::unique_ptr<Entry>> entries_;
+  std::mutex lock_;
+  uint64_t clock_;
+  size_t unpinned_size_;
+
+  MappedFiles() : clock_(0), unpinned_size_(0) {}
+
+  static size_t TailSlack(size_t size) {
+    SYSTEM_INFO si;
+    ::GetSystemInfo(&si);
+    size_t tail = size % si.dwPageSize;
+    return tail ? si.dwPageSize - tail : 0;
+  }
+};
+
+// The files loaded by LoadFileOnce() by unique id.
+std::unordered_map<long long, Range<char>>& LoadedFileMap() {
   static std::unordered_map<long long, Range<char>> map;
-  static size_t total_size = 0;
+  return map;
+}
 
-  File file = File::Create(path, FileParams::ReadSharedRead(), FileSecurity());
-  if (!file.IsValid())
+// Loads an entire file into memory, keeping only one copy. The file stays
+// mapped until UnloadFiles() lets go of it.
+Range<char> LoadFileOnce(const FilePath& path) {
+  std::lock_guard<std::mutex> lock(load_file_lock);
+  auto& map = LoadedFileMap();
+
+  Range<char> range;
+  long long id;
+  if (!MappedFiles::Get().Acquire(path, range, id))
     throw IOException(__LINE__, path.Raw());
-  long long id = file.GetUniqueId();
+
   auto it = map.find(id);
-  if (it != map.end())
+  if (it != map.end()) {
+    MappedFiles::Get().Release(id);
     return it->second;
-
-  size_t size = file.SizeInBytes();
-  if (size + total_size > (1024 * 1024 * 256))
-    throw IOException(__LINE__, path.Raw());
+  }
 
   Logger::Get().AddFileInfoStart(path);
 
-  Range<char> range(size);
-  size = file.Read(range, 0);
-  if (size != range.Size())
-    throw IOException(__LINE__, path.Raw());
-
   map[id] = range;
-  total_size += size;
+  LoadedFiles().push_back(LoadedFile(path.Raw(), range, id));
   return range;
 }
 
+// Forgets the files loaded by LoadFileOnce() for which |keep| returns false so
+// the next load reads them again. No token can refer to them anymore.
+void UnloadFiles(const std::function<bool(const LoadedFile&)>& keep) {
+  std::lock_guard<std::mutex> lock(load_file_lock);
+  auto& files = LoadedFiles();
+  auto last = std::stable_partition(begin(files), end(files), keep);
+  for (auto it = last; it != end(files); ++it) {
+    LoadedFileMap().erase(it->id);
+    MappedFiles::Get().Release(it->id);
+  }
+  files.erase(last, end(files));
+}
+
+// The path of the loaded file that |text| points into, or an empty string for
+// text that plex made up.
+std::wstring FindLoadedFile(const char* text) {
+  std::lock_guard<std::mutex> lock(load_file_lock);
+  for (auto& lf : LoadedFiles()) {
+    if ((text >= lf.contents.Start()) && (text < lf.contents.End()))
+      return lf.path;
+  }
+  return std::wstring();
+}
+
+// True if |path| is one of the files loaded by LoadFileOnce(). Files are told
+// apart by their unique id so that two spellings of one path match.
+bool IsLoadedFile(const FilePath& path) {
+  File file = File::Create(path, FileParams::ReadSharedRead(), FileSecurity());
+  if (!file.IsValid())
+    return false;
+  auto id = file.GetUniqueId();
+  std::lock_guard<std::mutex> lock(load_file_lock);
+  for (auto& lf : LoadedFiles()) {
+    if (lf.id == id)
+      return true;
+  }
+  return false;
+}
+
+#pragma endregion
+
+#pragma region stats
+
+uint64_t Ticks() {
+  LARGE_INTEGER li;
+  ::QueryPerformanceCounter(&li);
+  return li.QuadPart;
+}
+
+double TicksToSeconds(uint64_t ticks) {
+  static const double frequency = []() {
+    LARGE_INTEGER li;
+    ::QueryPerformanceFrequency(&li);
+    return static_cast<double>(li.QuadPart);
+  }();
+  return ticks / frequency;
+}
+
+// User plus kernel time of the process, in seconds.
+double ProcessCpuSeconds() {
+  FILETIME creation, exit, kernel, user;
+  if (!::GetProcessTimes(::GetCurrentProcess(), &creation, &exit, &kernel, &user))
+    return 0.0;
+  auto to_u64 = [](const FILETIME& ft) {
+    return (static_cast<uint64_t>(ft.dwHighDateTime) << 32) | ft.dwLowDateTime;
+  };
+  return (to_u64(kernel) + to_u64(user)) / 1.0e7;
+}
+
+size_t PeakWorkingSet() {
+  PROCESS_MEMORY_COUNTERS pmc = {0};
+  pmc.cb = sizeof(pmc);
+  if (!::GetProcessMemoryInfo(::GetCurrentProcess(), &pmc, sizeof(pmc)))
+    return 0;
+  return pmc.PeakWorkingSetSize;
+}
+
+// Counters behind --stats. The tokenizer and lexer ones are updated by the
+// worker threads that lex the catalog so their times add up thread time.
+struct PlexCounters {
+  std::atomic<uint64_t> tokenize_ticks;
+  std::atomic<uint64_t> tokenize_bytes;
+  std::atomic<uint64_t> tokenize_tokens;
+  std::atomic<uint64_t> lex_ticks;
+  std::atomic<uint64_t> lex_tokens;
+  std::atomic<uint64_t> catalog_files;
+  std::atomic<uint64_t> cache_hits;
+  std::atomic<uint64_t> bytes_written;
+};
+
+PlexCounters plex_counters;
+
+// Adds the ticks spent in the enclosing scope to |counter|.
+class ScopedTicks {
+  std::atomic<uint64_t>& counter_;
+  uint64_t start_;
+
+public:
+  explicit ScopedTicks(std::atomic<uint64_t>& counter)
+      : counter_(counter), start_(Ticks()) {
+  }
+
+  ~ScopedTicks() {
+    counter_ += Ticks() - start_;
+  }
+};
+
+// Wall and CPU time of each phase of a run, reported by --stats.
+class RunStats {
+  struct Phase {
+    std::string name;
+    double wall;
+    double cpu;
+  };
+
+  std::vector<Phase> phases_;
+  uint64_t mark_ticks_;
+  double mark_cpu_;
+
+public:
+  RunStats() : mark_ticks_(Ticks()), mark_cpu_(ProcessCpuSeconds()) {
+  }
+
+  // Closes the phase that started at the previous call.
+  void EndPhase(const char* name) {
+    auto ticks = Ticks();
+    auto cpu = ProcessCpuSeconds();
+    Phase phase = { name, TicksToSeconds(ticks - mark_ticks_), cpu - mark_cpu_ };
+    phases_.push_back(phase);
+    mark_ticks_ = ticks;
+    mark_cpu_ = cpu;
+  }
+
+  std::string ToText(size_t entities) const {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(3);
+    double wall = 0.0, cpu = 0.0;
+    for (auto& p : phases_) {
+      oss << "phase " << std::left << std::setw(10) << p.name << std::right
+          << " wall " << std::setw(8) << p.wall << " s   cpu " << std::setw(8) << p.cpu << " s\n";
+      wall += p.wall;
+      cpu += p.cpu;
+    }
+    oss << "total            wall " << std::setw(8) << wall << " s   cpu " << std::setw(8) << cpu << " s\n";
+
+    auto& c = plex_counters;
+    oss << std::setprecision(1);
+    oss << "tokenize   " << c.tokenize_bytes << " bytes " << c.tokenize_tokens << " tokens "
+        << Rate(c.tokenize_bytes, c.tokenize_ticks) / (1024 * 1024) << " MB/s "
+        << Rate(c.tokenize_tokens, c.tokenize_ticks) / 1000 << " Ktok/s\n";
+    oss << "lex        " << c.lex_tokens << " tokens "
+        << Rate(c.lex_tokens, c.lex_ticks) / 1000 << " Ktok/s\n";
+    oss << "catalog    " << c.catalog_files << " files " << c.cache_hits << " cache hits "
+        << entities << " entities\n";
+    oss << "output     " << c.bytes_written << " bytes\n";
+    auto arena = RunArena().GetStats();
+    oss << "arena      " << arena.objects << " objects " << arena.bytes << " bytes "
+        << arena.blocks << " blocks " << arena.releases << " releases\n";
+    oss << "peak rss   " << PeakWorkingSet() / 1024 << " KB\n";
+    return oss.str();
+  }
+
+  std::string ToJson(size_t entities) const {
+    std::ostringstream oss;
+    oss << std::fixed << std::setprecision(6);
+    oss << "{\"version\": \"" << plex_version << "\", \"phases\": [";
+    for (size_t ix = 0; ix != phases_.size(); ++ix) {
+      auto& p = phases_[ix];
+      oss << (ix ? ", " : "") << "{\"name\": \"" << p.name << "\", \"wall_s\": " << p.wall
+          << ", \"cpu_s\": " << p.cpu << "}";
+    }
+    auto& c = plex_counters;
+    oss << "], \"tokenize\": {\"bytes\": " << c.tokenize_bytes
+        << ", \"tokens\": " << c.tokenize_tokens
+        << ", \"seconds\": " << TicksToSeconds(c.tokenize_ticks)
+        << ", \"bytes_per_s\": " << Rate(c.tokenize_bytes, c.tokenize_ticks)
+        << ", \"tokens_per_s\": " << Rate(c.tokenize_tokens, c.tokenize_ticks) << "}"
+        << ", \"lex\": {\"tokens\": " << c.lex_tokens
+        << ", \"seconds\": " << TicksToSeconds(c.lex_ticks)
+        << ", \"tokens_per_s\": " << Rate(c.lex_tokens, c.lex_ticks) << "}"
+        << ", \"catalog_files\": " << c.catalog_files
+        << ", \"cache_hits\": " << c.cache_hits
+        << ", \"entities\": " << entities
+        << ", \"bytes_written\": " << c.bytes_written;
+    auto arena = RunArena().GetStats();
+    oss << ", \"arena\": {\"objects\": " << arena.objects
+        << ", \"bytes\": " << arena.bytes
+        << ", \"blocks\": " << arena.blocks
+        << ", \"releases\": " << arena.releases << "}"
+        << ", \"peak_rss\": " << PeakWorkingSet() << "}\n";
+    return oss.str();
+  }
+
+private:
+  static double Rate(uint64_t count, uint64_t ticks) {
+    return ticks ? count / TicksToSeconds(ticks) : 0.0;
+  }
+};
+
 #pragma endregion
 
 #pragma region cpptoken
@@ -889,14 +1427,71 @@ struct KeyElements {
   std::unordered_map<std::string, std::vector<std::string>> properties;
   std::unordered_map<size_t, size_t> if_exists;
   std::vector<std::string> plex_comments;
+  // |scopes| positions ordered by start and the parent of each, see IndexScopes().
+  std::vector<size_t> scope_order;
+  std::vector<size_t> scope_parent;
+
+  static const size_t kNoScope = static_cast<size_t>(-1);
 
   KeyElements(const FilePath& path) : src_path(path) {
     scopes.reserve(20);
   }
+
+  // The lexer adds a scope when it is closed so |scopes| is ordered by end. Ordered
+  // by start the scopes nest instead: a scope is followed by the scopes inside it,
+  // so the queries below are a binary search plus a walk up the parents rather
+  // than a scan of every scope in the file.
+  void IndexScopes() {
+    scope_order.resize(scopes.size());
+    for (size_t ix = 0; ix != scopes.size(); ++ix)
+      scope_order[ix] = ix;
+    std::sort(begin(scope_order), end(scope_order), [this](size_t a, size_t b) {
+      return scopes[a].start < scopes[b].start;
+    });
+    scope_parent.assign(scopes.size(), kNoScope);
+    std::vector<size_t> open;
+    for (size_t ix = 0; ix != scope_order.size(); ++ix) {
+      auto start = scopes[scope_order[ix]].start;
+      while (!open.empty() && (scopes[scope_order[open.back()]].end < start))
+        open.pop_back();
+      if (!open.empty())
+        scope_parent[ix] = open.back();
+      open.push_back(ix);
+    }
+  }
+
+  // The scope whose "{" is the token at |start|, or null.
+  const ScopeBlock* ScopeAt(size_t start) const {
+    auto ix = LastScopeBefore(start + 1);
+    if (ix == kNoScope)
+      return nullptr;
+    auto& s = scopes[scope_order[ix]];
+    return (s.start == start) ? &s : nullptr;
+  }
+
+  // The innermost scope of |type| that encloses the token at |pos|, or null.
+  const ScopeBlock* EnclosingScope(size_t pos, ScopeBlock::Type type) const {
+    for (auto ix = LastScopeBefore(pos); ix != kNoScope; ix = scope_parent[ix]) {
+      auto& s = scopes[scope_order[ix]];
+      if ((s.end > pos) && (s.type == type))
+        return &s;
+    }
+    return nullptr;
+  }
+
+private:
+  // Position in |scope_order| of the last scope that starts before |pos|.
+  size_t LastScopeBefore(size_t pos) const {
+    auto it = std::lower_bound(begin(scope_order), end(scope_order), pos,
+        [this](size_t ix, size_t pos) { return scopes[ix].start < pos; });
+    return (it == begin(scope_order)) ? kNoScope : (it - begin(scope_order)) - 1;
+  }
 };
 
+const size_t KeyElements::kNoScope;
+
 struct CppToken {
-  enum Type {
+  enum Type : unsigned int {
     none,
     unknown,
     sos,                // start of token stream.
@@ -1084,144 +1679,680 @@ struct CppToken {
     plex_comment,
     plex_pragma,
     plex_insert,
+    plex_disabled,
   };
 
+  // Lines longer than this are rejected by the tokenizer.
+  static const int kMaxColumn = (1 << 24) - 1;
+
   Range<char> range;
-  Type type;
-  int line;
-  int col;
 
   union {
     Insert* insert;
     KeyElements* kelems;  // Only applies for SOS token.
   };
 
+  int line;
+  int col;
+  Type type;
+
   CppToken(const Range<char>& range, CppToken::Type type, int line, int col)
-    : range(range), type(type), line(line), col(col), insert(nullptr) { }
+    : range(range), insert(nullptr), line(line), col(col), type(type) { }
 };
 
-struct Insert {
-  enum Kind {
-    delete_original,
-    keep_original,
-  };
+static_assert(CppToken::plex_disabled < 256, "CppToken::Type must fit in 8 bits");
 
-  Kind kind;
-  std::vector<CppToken> tv;
+class CppTokenVector;
 
-  Insert(Kind kind, const CppToken& tok) : kind(kind) {
-    tv.push_back(tok);
-  }
+// A token in a CppTokenVector. It reads and writes the fields in place so it is
+// passed by value, like an iterator. Converts to a CppToken copy.
+template <typename V>
+class CppTokenRefT {
+  V* tv_;
+  size_t ix_;
 
-  Insert(Kind kind) : kind(kind) {
+  template <typename U> friend class CppTokenRefT;
+
+public:
+  CppTokenRefT(V* tv, size_t ix) : tv_(tv), ix_(ix) {}
+
+  // A mutable token converts to a read only one.
+  template <typename U>
+  CppTokenRefT(const CppTokenRefT<U>& other) : tv_(other.tv_), ix_(other.ix_) {}
+
+  CppToken::Type type() const { return tv_->TypeAt(ix_); }
+  Range<char> range() const { return tv_->RangeAt(ix_); }
+  int line() const { return tv_->LineAt(ix_); }
+  int col() const { return tv_->ColAt(ix_); }
+  Insert* insert() const { return static_cast<Insert*>(tv_->SideAt(ix_)); }
+  KeyElements* kelems() const { return static_cast<KeyElements*>(tv_->SideAt(ix_)); }
+
+  void set_type(CppToken::Type type) const { tv_->SetType(ix_, type); }
+  void set_range(const Range<char>& range) const { tv_->SetRange(ix_, range); }
+  void set_line(int line) const { tv_->SetLine(ix_, line); }
+  void set_insert(Insert* insert) const { tv_->SetSide(ix_, insert); }
+  void set_kelems(KeyElements* kelems) const { tv_->SetSide(ix_, kelems); }
+
+  operator CppToken() const { return tv_->Get(ix_); }
+
+  // Assignment copies the token, not the reference.
+  const CppTokenRefT& operator=(const CppToken& tok) const {
+    tv_->Put(ix_, tok);
+    return *this;
   }
 
-  // This returns a singleton deleter that can be used
-  // in many places without extra cost.
-  static Insert* TokenDeleter() {
-    static auto insert = new Insert(delete_original);
-    return insert;
+  const CppTokenRefT& operator=(const CppTokenRefT& other) const {
+    tv_->Put(ix_, other);
+    return *this;
   }
 };
 
-std::string ToString(const CppToken& tok) {
-  return ToString(tok.range);
-}
+typedef CppTokenRefT<CppTokenVector> CppTokenRef;
+typedef CppTokenRefT<const CppTokenVector> CppTokenConstRef;
 
-bool EqualToStr(const CppToken& tok, const Range<const char>& r) {
-  return tok.range.Equal(r);
-}
+template <typename V>
+class CppTokenIteratorT {
+  V* tv_;
+  size_t ix_;
 
-template<typename T, size_t count>
-size_t FindToken(T (&kw)[count], const Range<char>& r) {
- auto f = std::lower_bound(&kw[0], &kw[count], r, 
-    [] (const char* kw, const Range<char>& v) {
-      return strncmp(kw, v.Start(), v.Size()) < 0;
-  });
-  if (f == &kw[count]) 
-    return -1;
-  if (::strncmp(*f,  r.Start(), r.Size()) != 0)
-    return -1;
-  if ((*f)[r.Size()] != 0)
-    return -1;
-  return (f - kw );
-}
+  template <typename U> friend class CppTokenIteratorT;
 
-CppToken::Type GetCppKeywordType(const Range<char>& r) {
-  // The 86 c++11 keywords.
-  const char* kw[] = {
-    "__if_exists",
-    "__except", "__try",
-    "alignas", "alignof", "and", "and_eq",
-    "asm", "auto", "bitand", "bitor",
-    "bool", "break", "case", "catch",
-    "char", "char16_t", "char32_t", "class",
-    "compl", "const", "constexpr", "const_cast",
-    "continue", "decltype", "default", "delete",
-    "do", "double", "dynamic_cast", "else",
-    "enum", "explicit", "export", "extern",
-    "false", "final", "float", "for",
-    "friend", "goto", "if", "inline",
-    "int", "long", "mutable", "namespace",
-    "new", "noexcept", "not", "not_eq",
-    "nullptr", "operator", "or", "or_eq",
-    "override", "private", "protected", "public",
-    "register", "reinterpret_cast", "return", "short",
-    "signed", "sizeof", "static", "static_assert", 
-    "static_cast", "struct", "switch", "template",
-    "this", "thread_local", "throw", "true",
-    "try", "typedef", "typeid", "typename",
-    "union", "unsigned", "using", "virtual",
-    "void", "volatile", "wchar_t", "while",
-    "xor", "xor_eq",
+public:
+  typedef std::random_access_iterator_tag iterator_category;
+  typedef CppToken value_type;
+  typedef ptrdiff_t difference_type;
+  typedef CppTokenRefT<V> reference;
+
+  // What operator->() returns, so that it->type() works.
+  class pointer {
+    reference ref_;
+  public:
+    explicit pointer(const reference& ref) : ref_(ref) {}
+    const reference* operator->() const { return &ref_; }
   };
 
-  size_t off = FindToken(kw, r);
-  return (off == -1) ?
-      CppToken::unknown :
-      static_cast<CppToken::Type>(CppToken::kw_start + off + 1);
-}
+  CppTokenIteratorT() : tv_(nullptr), ix_(0) {}
+  CppTokenIteratorT(V* tv, size_t ix) : tv_(tv), ix_(ix) {}
+
+  template <typename U>
+  CppTokenIteratorT(const CppTokenIteratorT<U>& other) : tv_(other.tv_), ix_(other.ix_) {}
+
+  size_t Index() const { return ix_; }
+
+  reference operator*() const { return reference(tv_, ix_); }
+  pointer operator->() const { return pointer(reference(tv_, ix_)); }
+  reference operator[](ptrdiff_t n) const { return reference(tv_, ix_ + n); }
+
+  CppTokenIteratorT& operator++() { ++ix_; return *this; }
+  CppTokenIteratorT& operator--() { --ix_; return *this; }
+  CppTokenIteratorT operator++(int) { auto r = *this; ++ix_; return r; }
+  CppTokenIteratorT operator--(int) { auto r = *this; --ix_; return r; }
+  CppTokenIteratorT& operator+=(ptrdiff_t n) { ix_ += n; return *this; }
+  CppTokenIteratorT& operator-=(ptrdiff_t n) { ix_ -= n; return *this; }
+  CppTokenIteratorT operator+(ptrdiff_t n) const { return CppTokenIteratorT(tv_, ix_ + n); }
+  CppTokenIteratorT operator-(ptrdiff_t n) const { return CppTokenIteratorT(tv_, ix_ - n); }
+  ptrdiff_t operator-(const CppTokenIteratorT& other) const { return ix_ - other.ix_; }
+
+  bool operator==(const CppTokenIteratorT& other) const { return ix_ == other.ix_; }
+  bool operator!=(const CppTokenIteratorT& other) const { return ix_ != other.ix_; }
+  bool operator<(const CppTokenIteratorT& other) const { return ix_ < other.ix_; }
+  bool operator>(const CppTokenIteratorT& other) const { return ix_ > other.ix_; }
+  bool operator<=(const CppTokenIteratorT& other) const { return ix_ <= other.ix_; }
+  bool operator>=(const CppTokenIteratorT& other) const { return ix_ >= other.ix_; }
+};
 
-CppToken::Type GetCppPreprocessorKeyword(const Range<char>& r) {
-  const char* kw[] = {
-    "define", "else", "endif", "error",
-    "if", "ifdef", "ifndef", "include",
-    "line", "pragma", "undef",
-  };
-  size_t off = FindToken(kw, r);
-  return (off == -1) ?
-      CppToken::unknown :
-      static_cast<CppToken::Type>(CppToken::prep_start + off + 1);
-}
+// Tokens are the bulk of plex's memory, so a token vector keeps each field in an
+// array of its own: a 32-bit offset from the first token and a 32-bit length for
+// the range, 8 bits of type and 16 bits each of line and column. The line is
+// stored as the difference to the line of the first token of its block of 64,
+// which also makes moving all the lines by the same amount cheap. That is 13
+// bytes a token instead of the 32 of a CppToken.
+//
+// The values that don't fit go to side tables: ranges that are not within 4 GB
+// after the first token, lines and columns past 16 bits, and the insert and key
+// elements pointers, which only a few tokens have. A flag bit in the length says
+// if a token has a side pointer, so the writers don't look it up for each token.
+// Tokens are read as a CppToken copy or in place through CppTokenRef.
+class CppTokenVector {
+public:
+  typedef CppTokenIteratorT<CppTokenVector> iterator;
+  typedef CppTokenIteratorT<const CppTokenVector> const_iterator;
+  typedef CppTokenRef reference;
+  typedef CppTokenConstRef const_reference;
+  typedef CppToken value_type;
+  typedef size_t size_type;
+
+  CppTokenVector() : base_(nullptr) {}
+
+  CppTokenVector(const CppTokenVector& other)
+      : start_(other.start_), size_(other.size_), type_(other.type_),
+        line_(other.line_), col_(other.col_), line_base_(other.line_base_),
+        base_(other.base_),
+        extra_(other.extra_ ? new Extra(*other.extra_) : nullptr) {
+  }
 
-bool IsPredefinedMacro(const Range<char>& r) {
-  const char* kw[] = {
-    "_ATL_VER", "_CPPRTTI", "_CPPUNWIND", "_DEBUG", "_DLL",
-    "_MSC_VER", "_MT", "_M_IX86", "_M_X64", "_WIN32", "_WIN64",
-    "__COUNTER__", "__DATE__", "__FILE__",
-    "__FUNCDNAME__", "__FUNCSIG__", "__FUNCTION__",
-    "__LINE__", "__STDC__", "__TIME__", "__TIMESTAMP__",
-  };
+  CppTokenVector(CppTokenVector&& other) : base_(nullptr) {
+    swap(other);
+  }
 
-  return FindToken(kw, r) != -1;
-}
+  CppTokenVector& operator=(CppTokenVector other) {
+    swap(other);
+    return *this;
+  }
 
-CppToken::Type GetTwoTokenType(const CppToken& first, const CppToken& second) {
-  const char* kw[] = {
-    "!=", "%=", "&&", "&=", 
-    "*=", "++", "+=", "--", 
-    "-=", "->", "//", "/=", "::", 
-    "<<", "<=", "==", ">=",
+  CppTokenVector(std::initializer_list<CppToken> tokens) : base_(nullptr) {
+    reserve(tokens.size());
+    for (auto& tok : tokens)
+      push_back(tok);
+  }
+
+  CppTokenVector(const_iterator first, const_iterator last) : base_(nullptr) {
+    reserve(last - first);
+    for (; first != last; ++first)
+      push_back(*first);
+  }
+
+  size_t size() const { return type_.size(); }
+  bool empty() const { return type_.empty(); }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, size()); }
+  const_iterator begin() const { return const_iterator(this, 0); }
+  const_iterator end() const { return const_iterator(this, size()); }
+
+  reference operator[](size_t ix) { return reference(this, ix); }
+  const_reference operator[](size_t ix) const { return const_reference(this, ix); }
+
+  reference at(size_t ix) {
+    if (ix >= size())
+      throw std::out_of_range("CppTokenVector");
+    return reference(this, ix);
+  }
+
+  reference front() { return reference(this, 0); }
+  reference back() { return reference(this, size() - 1); }
+  const_reference front() const { return const_reference(this, 0); }
+  const_reference back() const { return const_reference(this, size() - 1); }
+
+  void reserve(size_t count) {
+    start_.reserve(count);
+    size_.reserve(count);
+    type_.reserve(count);
+    line_.reserve(count);
+    col_.reserve(count);
+    line_base_.reserve((count + kBlockSize - 1) / kBlockSize);
+  }
+
+  void swap(CppTokenVector& other) {
+    start_.swap(other.start_);
+    size_.swap(other.size_);
+    type_.swap(other.type_);
+    line_.swap(other.line_);
+    col_.swap(other.col_);
+    line_base_.swap(other.line_base_);
+    std::swap(base_, other.base_);
+    extra_.swap(other.extra_);
+  }
+
+  void push_back(const CppToken& tok) {
+    const size_t ix = size();
+    if (!(ix % kBlockSize))
+      line_base_.push_back(tok.line);
+    // Most tokens fit in the arrays as they are, without the side tables.
+    const int delta = tok.line - line_base_.back();
+    const uintptr_t offset = reinterpret_cast<uintptr_t>(tok.range.Start()) -
+                             reinterpret_cast<uintptr_t>(base_);
+    const bool fits = base_ && tok.range.Start() && (offset <= 0xFFFFFFFF) &&
+                      (tok.range.Size() < kFar) && (delta >= 0) && (delta < kWide) &&
+                      (tok.col >= 0) && (tok.col < kWide) && !tok.insert;
+    start_.push_back(fits ? static_cast<uint32_t>(offset) : 0);
+    size_.push_back(fits ? static_cast<uint32_t>(tok.range.Size()) : 0);
+    type_.push_back(static_cast<uint8_t>(tok.type));
+    line_.push_back(fits ? static_cast<uint16_t>(delta) : 0);
+    col_.push_back(fits ? static_cast<uint16_t>(tok.col) : 0);
+    if (!fits)
+      Put(ix, tok);
+  }
+
+  // Appends the tokens of |other|.
+  void append(const CppTokenVector& other) {
+    for (size_t ix = 0; ix != other.size(); ++ix)
+      push_back(other.Get(ix));
+  }
+
+  void erase(iterator first, iterator last) {
+    const size_t count = last - first;
+    for (size_t ix = last.Index(); ix != size(); ++ix)
+      Put(ix - count, Get(ix));
+    Truncate(size() - count);
+  }
+
+  void erase(iterator pos) {
+    erase(pos, pos + 1);
+  }
+
+  // Adds |delta| to the line of every token.
+  void ShiftLines(int delta) {
+    for (auto& base : line_base_)
+      base += delta;
+    if (extra_) {
+      for (auto& wl : extra_->wide_lines)
+        wl.second += delta;
+    }
+  }
+
+  CppToken Get(size_t ix) const {
+    CppToken tok(RangeAt(ix), TypeAt(ix), LineAt(ix), ColAt(ix));
+    tok.insert = static_cast<Insert*>(SideAt(ix));
+    return tok;
+  }
+
+  void Put(size_t ix, const CppToken& tok) {
+    SetType(ix, tok.type);
+    SetRange(ix, tok.range);
+    SetLine(ix, tok.line);
+    SetCol(ix, tok.col);
+    SetSide(ix, tok.insert);
+  }
+
+private:
+  template <typename V> friend class CppTokenRefT;
+
+  static const size_t kBlockSize = 64;
+  static const uint32_t kHasSide = 0x80000000;
+  static const uint32_t kFar = 0x7FFFFFFF;
+  static const uint16_t kWide = 0xFFFF;
+
+  // The range is at |base_| + |start_| unless its |size_| is kFar, then it is
+  // far[start_] in |extra_|.
+  std::vector<uint32_t> start_;
+  std::vector<uint32_t> size_;
+  std::vector<uint8_t> type_;
+  std::vector<uint16_t> line_;
+  std::vector<uint16_t> col_;
+  std::vector<int> line_base_;
+  char* base_;
+
+  // The side tables. Many vectors don't need them so they are made on demand.
+  struct Extra {
+    std::vector<Range<char>> far;
+    std::unordered_map<uint32_t, int> wide_lines;
+    std::unordered_map<uint32_t, int> wide_cols;
+    std::unordered_map<uint32_t, void*> side;
+  };
+  std::unique_ptr<Extra> extra_;
+
+  Extra& GetExtra() {
+    if (!extra_)
+      extra_.reset(new Extra);
+    return *extra_;
+  }
+
+  CppToken::Type TypeAt(size_t ix) const {
+    return static_cast<CppToken::Type>(type_[ix]);
+  }
+
+  Range<char> RangeAt(size_t ix) const {
+    auto size = size_[ix] & ~kHasSide;
+    if (size == kFar)
+      return extra_->far[start_[ix]];
+    auto start = base_ + start_[ix];
+    return Range<char>(start, start + size);
+  }
+
+  int LineAt(size_t ix) const {
+    auto line = line_[ix];
+    if (line == kWide)
+      return extra_->wide_lines.find(static_cast<uint32_t>(ix))->second;
+    return line_base_[ix / kBlockSize] + line;
+  }
+
+  int ColAt(size_t ix) const {
+    auto col = col_[ix];
+    if (col == kWide)
+      return extra_->wide_cols.find(static_cast<uint32_t>(ix))->second;
+    return col;
+  }
+
+  void* SideAt(size_t ix) const {
+    if (!(size_[ix] & kHasSide))
+      return nullptr;
+    return extra_->side.find(static_cast<uint32_t>(ix))->second;
+  }
+
+  void SetType(size_t ix, CppToken::Type type) {
+    type_[ix] = static_cast<uint8_t>(type);
+  }
+
+  void SetRange(size_t ix, const Range<char>& range) {
+    if (!base_)
+      base_ = range.Start();
+    // Unsigned, so a range before |base_| is far too.
+    const uintptr_t offset = reinterpret_cast<uintptr_t>(range.Start()) -
+                             reinterpret_cast<uintptr_t>(base_);
+    const size_t size = range.Size();
+    const uint32_t side = size_[ix] & kHasSide;
+    if (range.Start() && (offset <= 0xFFFFFFFF) && (size < kFar)) {
+      start_[ix] = static_cast<uint32_t>(offset);
+      size_[ix] = side | static_cast<uint32_t>(size);
+    } else {
+      auto& far = GetExtra().far;
+      start_[ix] = static_cast<uint32_t>(far.size());
+      size_[ix] = side | kFar;
+      far.push_back(range);
+    }
+  }
+
+  // The first token of a block is its base. The lexer moves tokens back over the
+  // ones it erases, so without this the lines of its blocks would drift apart.
+  void SetLine(size_t ix, int line) {
+    if (!(ix % kBlockSize) && (line != line_base_[ix / kBlockSize]))
+      Rebase(ix / kBlockSize, line);
+    EncodeLine(ix, line);
+  }
+
+  void Rebase(size_t block, int base) {
+    const size_t first = block * kBlockSize;
+    const size_t last = std::min(first + kBlockSize, size());
+    int lines[kBlockSize];
+    for (size_t ix = first; ix != last; ++ix)
+      lines[ix - first] = LineAt(ix);
+    line_base_[block] = base;
+    for (size_t ix = first; ix != last; ++ix)
+      EncodeLine(ix, lines[ix - first]);
+  }
+
+  void EncodeLine(size_t ix, int line) {
+    const int delta = line - line_base_[ix / kBlockSize];
+    if (line_[ix] == kWide)
+      extra_->wide_lines.erase(static_cast<uint32_t>(ix));
+    if ((delta >= 0) && (delta < kWide)) {
+      line_[ix] = static_cast<uint16_t>(delta);
+    } else {
+      line_[ix] = kWide;
+      GetExtra().wide_lines[static_cast<uint32_t>(ix)] = line;
+    }
+  }
+
+  void SetCol(size_t ix, int col) {
+    if (col_[ix] == kWide)
+      extra_->wide_cols.erase(static_cast<uint32_t>(ix));
+    if ((col >= 0) && (col < kWide)) {
+      col_[ix] = static_cast<uint16_t>(col);
+    } else {
+      col_[ix] = kWide;
+      GetExtra().wide_cols[static_cast<uint32_t>(ix)] = col;
+    }
+  }
+
+  void SetSide(size_t ix, void* ptr) {
+    if (ptr) {
+      GetExtra().side[static_cast<uint32_t>(ix)] = ptr;
+      size_[ix] |= kHasSide;
+    } else if (size_[ix] & kHasSide) {
+      extra_->side.erase(static_cast<uint32_t>(ix));
+      size_[ix] &= ~kHasSide;
+    }
+  }
+
+  // Drops the tokens from |count| on.
+  void Truncate(size_t count) {
+    for (size_t ix = count; ix != size(); ++ix) {
+      if (line_[ix] == kWide)
+        extra_->wide_lines.erase(static_cast<uint32_t>(ix));
+      if (col_[ix] == kWide)
+        extra_->wide_cols.erase(static_cast<uint32_t>(ix));
+      SetSide(ix, nullptr);
+    }
+    start_.resize(count);
+    size_.resize(count);
+    type_.resize(count);
+    line_.resize(count);
+    col_.resize(count);
+    line_base_.resize((count + kBlockSize - 1) / kBlockSize);
+  }
+};
+
+inline CppTokenVector::iterator begin(CppTokenVector& tv) { return tv.begin(); }
+inline CppTokenVector::iterator end(CppTokenVector& tv) { return tv.end(); }
+inline CppTokenVector::const_iterator begin(const CppTokenVector& tv) { return tv.begin(); }
+inline CppTokenVector::const_iterator end(const CppTokenVector& tv) { return tv.end(); }
+
+struct Insert {
+  enum Kind {
+    delete_original,
+    keep_original,
+  };
+
+  Kind kind;
+  CppTokenVector tv;
+
+  Insert(Kind kind, const CppToken& tok) : kind(kind) {
+    tv.push_back(tok);
+  }
+
+  Insert(Kind kind) : kind(kind) {
+  }
+
+  // This returns a singleton deleter that can be used
+  // in many places without extra cost.
+  static Insert* TokenDeleter() {
+    static auto insert = new Insert(delete_original);
+    return insert;
+  }
+};
+
+std::string ToString(CppTokenConstRef tok) {
+  return ToString(tok.range());
+}
+
+bool EqualToStr(CppTokenConstRef tok, const Range<const char>& r) {
+  return tok.range().Equal(r);
+}
+
+template<typename T, size_t count>
+size_t FindToken(T (&kw)[count], const Range<char>& r) {
+ auto f = std::lower_bound(&kw[0], &kw[count], r, 
+    [] (const char* kw, const Range<char>& v) {
+      return strncmp(kw, v.Start(), v.Size()) < 0;
+  });
+  if (f == &kw[count]) 
+    return -1;
+  if (::strncmp(*f,  r.Start(), r.Size()) != 0)
+    return -1;
+  if ((*f)[r.Size()] != 0)
+    return -1;
+  return (f - kw );
+}
+
+// All c++ keywords, in the same order as the kw_start --> kw_end block.
+const char* const cpp_keywords[] = {
+  "__if_exists",
+  "__except", "__try",
+  "alignas", "alignof", "and", "and_eq",
+  "asm", "auto", "bitand", "bitor",
+  "bool", "break", "case", "catch",
+  "char", "char16_t", "char32_t", "class",
+  "compl", "const", "constexpr", "const_cast",
+  "continue", "decltype", "default", "delete",
+  "do", "double", "dynamic_cast", "else",
+  "enum", "explicit", "export", "extern",
+  "false", "final", "float", "for",
+  "friend", "goto", "if", "inline",
+  "int", "long", "mutable", "namespace",
+  "new", "noexcept", "not", "not_eq",
+  "nullptr", "operator", "or", "or_eq",
+  "override", "private", "protected", "public",
+  "register", "reinterpret_cast", "return", "short",
+  "signed", "sizeof", "static", "static_assert", 
+  "static_cast", "struct", "switch", "template",
+  "this", "thread_local", "throw", "true",
+  "try", "typedef", "typeid", "typename",
+  "union", "unsigned", "using", "virtual",
+  "void", "volatile", "wchar_t", "while",
+  "xor", "xor_eq",
+};
+
+static_assert(_countof(cpp_keywords) ==
+    size_t(CppToken::kw_end - CppToken::kw_start - 1), "Keywords");
+
+// The preprocessor keywords, in the same order as the prep_start --> prep_end block.
+const char* const cpp_prep_keywords[] = {
+  "define", "else", "endif", "error",
+  "if", "ifdef", "ifndef", "include",
+  "line", "pragma", "undef",
+};
+
+static_assert(_countof(cpp_prep_keywords) ==
+    size_t(CppToken::prep_end - CppToken::prep_start - 1), "PrepKeywords");
+
+const char* const cpp_predefined_macros[] = {
+  "_ATL_VER", "_CPPRTTI", "_CPPUNWIND", "_DEBUG", "_DLL",
+  "_MSC_VER", "_MT", "_M_IX86", "_M_X64", "_WIN32", "_WIN64",
+  "__COUNTER__", "__DATE__", "__FILE__",
+  "__FUNCDNAME__", "__FUNCSIG__", "__FUNCTION__",
+  "__LINE__", "__STDC__", "__TIME__", "__TIMESTAMP__",
+};
+
+// Perfect hash that maps a word to its token type with a single probe and one
+// memcmp. The slot is derived from the length and five characters of the word,
+// and the multiplier is searched when the table is built until no two words
+// collide. VS2013 has no usable constexpr, so the table is built on first use
+// rather than at compile time.
+class WordTable {
+  static const int kBits = 10;
+
+  struct Word {
+    const char* str;
+    size_t size;
+    CppToken::Type type;
+  };
+
+  std::vector<Word> words_;
+  unsigned char slots_[1 << kBits];
+  size_t max_size_;
+  uint64_t seed_;
+
+public:
+  WordTable() : max_size_(0), seed_(0) {
+  }
+
+  // Adds |words| with consecutive types starting at |first|, or all of them
+  // with the |first| type if |same_type| is true.
+  template <size_t count>
+  void Add(const char* const (&words)[count], CppToken::Type first, bool same_type) {
+    for (size_t ix = 0; ix != count; ++ix) {
+      auto type = same_type ? first : static_cast<CppToken::Type>(first + ix);
+      Word w = { words[ix], strlen(words[ix]), type };
+      words_.push_back(w);
+      max_size_ = std::max(max_size_, w.size);
+    }
+  }
+
+  void Build() {
+    if (words_.size() >= 0xFF)
+      throw PlexException(__LINE__, "word table too large");
+
+    for (uint64_t n = 0; n != 100000; ++n) {
+      seed_ = 0x9E3779B97F4A7C15ULL * (2 * n + 1);
+      memset(slots_, 0, sizeof(slots_));
+      bool collision = false;
+      for (size_t ix = 0; ix != words_.size(); ++ix) {
+        auto& slot = slots_[Slot(words_[ix].str, words_[ix].size)];
+        if (slot) {
+          collision = true;
+          break;
+        }
+        slot = static_cast<unsigned char>(ix + 1);
+      }
+      if (!collision)
+        return;
+    }
+    throw PlexException(__LINE__, "no perfect hash for word table");
+  }
+
+  CppToken::Type Find(const Range<char>& r) const {
+    auto size = r.Size();
+    if (!size || (size > max_size_))
+      return CppToken::unknown;
+    auto ix = slots_[Slot(r.Start(), size)];
+    if (!ix)
+      return CppToken::unknown;
+    auto& w = words_[ix - 1];
+    if ((w.size != size) || (memcmp(w.str, r.Start(), size) != 0))
+      return CppToken::unknown;
+    return w.type;
+  }
+
+private:
+  size_t Slot(const char* str, size_t size) const {
+    auto s = reinterpret_cast<const unsigned char*>(str);
+    const size_t last = size - 1;
+    const size_t second = (size > 1) ? 1 : 0;
+    uint64_t key = size ^
+                   (uint64_t(s[0]) << 8) ^
+                   (uint64_t(s[second]) << 16) ^
+                   (uint64_t(s[size / 2]) << 24) ^
+                   (uint64_t(s[last - second]) << 32) ^
+                   (uint64_t(s[last]) << 40);
+    return static_cast<size_t>((key * seed_) >> (64 - kBits));
+  }
+};
+
+// Keywords and predefined macros share a table since the lexer checks both for
+// every identifier-like token.
+const WordTable& GetIdentifierWordTable() {
+  struct Table : public WordTable {
+    Table() {
+      Add(cpp_keywords, static_cast<CppToken::Type>(CppToken::kw_start + 1), false);
+      Add(cpp_predefined_macros, CppToken::predef_macro, true);
+      Build();
+    }
+  };
+  static const Table table;
+  return table;
+}
+
+const WordTable& GetPreprocessorWordTable() {
+  struct Table : public WordTable {
+    Table() {
+      Add(cpp_prep_keywords, static_cast<CppToken::Type>(CppToken::prep_start + 1), false);
+      Build();
+    }
+  };
+  static const Table table;
+  return table;
+}
+
+CppToken::Type GetCppKeywordType(const Range<char>& r) {
+  auto type = GetIdentifierWordTable().Find(r);
+  return (type == CppToken::predef_macro) ? CppToken::unknown : type;
+}
+
+CppToken::Type GetCppPreprocessorKeyword(const Range<char>& r) {
+  return GetPreprocessorWordTable().Find(r);
+}
+
+bool IsPredefinedMacro(const Range<char>& r) {
+  return GetIdentifierWordTable().Find(r) == CppToken::predef_macro;
+}
+
+CppToken::Type GetTwoTokenType(CppTokenConstRef first, CppTokenConstRef second) {
+  const char* kw[] = {
+    "!=", "%=", "&&", "&=", 
+    "*=", "++", "+=", "--", 
+    "-=", "->", "//", "/=", "::", 
+    "<<", "<=", "==", ">=",
     ">>", "^=", "||", "|=" 
   };
 
   static_assert(_countof(kw) == 
       size_t(CppToken::ass_left_shift - CppToken::not_eq), "TwoToken");
 
-  if (first.range.End() != second.range.Start())
+  if (first.range().End() != second.range().Start())
     return CppToken::unknown;
 
-  size_t off = FindToken(kw, Range<char>(first.range.Start(), second.range.End()));
+  size_t off = FindToken(kw, Range<char>(first.range().Start(), second.range().End()));
   return (off == -1) ?
       CppToken::unknown :
       static_cast<CppToken::Type>(CppToken::not_eq + off);
@@ -1229,15 +2360,118 @@ CppToken::Type GetTwoTokenType(const CppToken& first, const CppToken& second) {
 
 #pragma endregion
 
-typedef std::vector<CppToken> CppTokenVector;
+#pragma region atoms
+
+// Identifiers are interned into a process wide table that hands out stable
+// 32-bit atoms, so the resolve phase looks up and compares names as integers
+// instead of building strings. The table only grows and keeps its own copy of
+// each name, so an atom stays valid after the file it came from is unloaded.
+// It is split in shards, each with its own lock, so batch units can intern
+// concurrently.
+typedef uint32_t Atom;
+
+class Atoms {
+public:
+  static const Atom kNone = 0;
+
+  static Atoms& Get() {
+    static Atoms* atoms = new Atoms;
+    return *atoms;
+  }
+
+  // Returns kNone if |name| was never interned.
+  Atom Find(const Range<char>& name) {
+    const Key key = { name, Hash(name) };
+    auto& shard = shards_[key.hash >> (64 - kShardBits)];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(key);
+    return (it != end(shard.map)) ? it->second : kNone;
+  }
+
+  Atom Intern(const Range<char>& name) {
+    const Key key = { name, Hash(name) };
+    auto& shard = shards_[key.hash >> (64 - kShardBits)];
+    std::lock_guard<std::mutex> lock(shard.lock);
+    auto it = shard.map.find(key);
+    if (it != end(shard.map))
+      return it->second;
+
+    // Deque elements don't move, so the key can point to the copy.
+    shard.names.push_back(ToString(name));
+    const Key own = { FromString(shard.names.back()), key.hash };
+    const Atom atom = static_cast<Atom>(
+        (shard.names.size() << kShardBits) | (key.hash >> (64 - kShardBits)));
+    shard.map[own] = atom;
+    return atom;
+  }
+
+private:
+  static const size_t kShardBits = 4;
+  static const size_t kShards = 1 << kShardBits;
+
+  struct Key {
+    Range<char> name;
+    uint64_t hash;
+  };
+
+  struct KeyHash {
+    size_t operator()(const Key& k) const {
+      return static_cast<size_t>(k.hash);
+    }
+  };
+
+  // Identifiers are short, so they are hashed a word at a time rather than
+  // with the bytewise FNV-1a. The top bits pick the shard.
+  static uint64_t Hash(const Range<char>& name) {
+    const uint64_t kMul = 0xff51afd7ed558ccdULL;
+    uint64_t h = name.Size() * 0x9e3779b97f4a7c15ULL;
+    const char* p = name.Start();
+    size_t left = name.Size();
+    for (; left >= 8; p += 8, left -= 8) {
+      uint64_t w;
+      memcpy(&w, p, 8);
+      h = (h ^ w) * kMul;
+      h ^= h >> 29;
+    }
+    if (left) {
+      uint64_t w = 0;
+      memcpy(&w, p, left);
+      h = (h ^ w) * kMul;
+      h ^= h >> 29;
+    }
+    return h * kMul;
+  }
+
+  struct KeyEq {
+    bool operator()(const Key& k1, const Key& k2) const {
+      return (k1.hash == k2.hash) && k1.name.Equal(k2.name);
+    }
+  };
+
+  struct Shard {
+    std::mutex lock;
+    std::unordered_map<Key, Atom, KeyHash, KeyEq> map;
+    std::deque<std::string> names;
+  };
+
+  Shard shards_[kShards];
+
+  Atoms() {}
+};
+
+Atom AtomOf(CppTokenConstRef tok) {
+  return Atoms::Get().Intern(tok.range());
+}
+
+#pragma endregion
 
 void DbgDumpTokens(CppTokenVector::iterator b, CppTokenVector::iterator e) {
   if (b > e)
     std::swap(e, b);
   wprintf(L"== token dump (%td) begin ==\n", (e - b) + 1);
   while (b <= e) {
-    auto t = ToString(b->range);
-    wprintf(L" [%S]  type:%d  line:%d\n", t.c_str(), b->type, b->line);
+    auto t = ToString(b->range());
+    wprintf(L" [%S]  type:%d  line:%d\n", t.c_str(), b->type(), b->line());
     ++b;
   }
   wprintf(L"== token dump end ==\n");
@@ -1246,148 +2480,710 @@ void DbgDumpTokens(CppTokenVector::iterator b, CppTokenVector::iterator e) {
 
 #pragma region tokenizer
 
-CppTokenVector TokenizeCpp(const FilePath& path, Range<char>* e_range = nullptr) {
-  Range<char> range = e_range ? *e_range : LoadFileOnce(path);
-  CppTokenVector tv;
-  tv.reserve(range.Size() / 3);
+// The tokenizer classifies each input byte into one of these classes. The
+// table is built once and indexed by the raw (unsigned) byte value.
+enum CharClass : unsigned char {
+  cc_invalid,     // non printable ascii, fatal.
+  cc_blank,       // tab (0x09) and space (0x20).
+  cc_newline,     // linefeed (0x0A).
+  cc_ident,       // A-Z a-z 0-9 and _ (which is 0x5F).
+  cc_symbol,      // one char symbol, see CppToken::symbols_begin.
+  cc_non_ascii,   // 0x80 and above, handled by DecodeUTF8Point().
+};
 
-  char* curr = range.Start();
-  char* str = nullptr;
-  char c = *curr;
+struct CharClassTable {
+  CharClass cls[256];
+  CppToken::Type symbol[256];
+
+  CharClassTable() {
+    for (int ix = 0; ix != 256; ++ix) {
+      symbol[ix] = CppToken::none;
+      if (ix >= 0x80)
+        cls[ix] = cc_non_ascii;
+      else if ((ix == 0x09) || (ix == 0x20))
+        cls[ix] = cc_blank;
+      else if (ix == 0x0A)
+        cls[ix] = cc_newline;
+      else if ((ix < 0x20) || (ix == 0x7F))
+        cls[ix] = cc_invalid;
+      else
+        cls[ix] = cc_ident;
+    }
+    // The symbol blocks map linearly to the CppToken one char token blocks.
+    AddSymbols(0x21, 0x2F, CppToken::logical_not);
+    AddSymbols(0x3A, 0x40, CppToken::colon);
+    AddSymbols(0x5B, 0x5E, CppToken::open_sqr_bracket);
+    AddSymbols(0x60, 0x60, CppToken::tilde);
+    AddSymbols(0x7B, 0x7E, CppToken::open_cur_bracket);
+  }
 
-  // The first token is always (s)tart-(o)f-(s)stream.
-  tv.push_back(CppToken(Range<char>(curr, curr), CppToken::sos, 0, 0));
-  tv.front().kelems = new KeyElements(path);
- 
-  int line = 1;
-  int column = 1;
+private:
+  void AddSymbols(int first, int last, CppToken::Type type) {
+    for (int ix = first; ix <= last; ++ix) {
+      cls[ix] = cc_symbol;
+      symbol[ix] = static_cast<CppToken::Type>(type + (ix - first));
+    }
+  }
+};
 
-  do {
-    int point = (c < 0x80) ? c :  DecodeUTF8Point(curr, range);
+const CharClassTable& GetCharClassTable() {
+  static const CharClassTable table;
+  return table;
+}
+
+#if defined(_M_X64) || (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define PLEX_TOKENIZER_SSE2 1
+#endif
 
-    if (point < 0) {
-      throw TokenizerException(path.Raw(), __LINE__, line);
+#if defined(PLEX_TOKENIZER_SSE2)
+
+// Returns a 16 bit mask with the bits set for bytes in the [lo, hi] range. SSE2
+// only has signed compares so the range is biased to start at -128.
+inline int SSE2RangeMask(__m128i v, char lo, char hi) {
+  auto bias = _mm_set1_epi8(static_cast<char>(0x80 - lo));
+  auto limit = _mm_set1_epi8(static_cast<char>(-128 + (hi - lo) + 1));
+  return _mm_movemask_epi8(_mm_cmplt_epi8(_mm_add_epi8(v, bias), limit));
+}
+
+inline int SSE2IdentMask(__m128i v) {
+  auto lower = _mm_or_si128(v, _mm_set1_epi8(0x20));
+  return SSE2RangeMask(v, '0', '9') |
+         SSE2RangeMask(lower, 'a', 'z') |
+         _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+}
+
+inline int SSE2BlankMask(__m128i v) {
+  return _mm_movemask_epi8(
+      _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(0x20)),
+                   _mm_cmpeq_epi8(v, _mm_set1_epi8(0x09))));
+}
+
+#endif
+
+// Returns the first character in [curr, end) that is not of |cls| class, which
+// can only be cc_ident or cc_blank. Runs are scanned 16 bytes at a time.
+char* ScanCharClassRun(char* curr, char* end, CharClass cls) {
+#if defined(PLEX_TOKENIZER_SSE2)
+  while ((end - curr) >= 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(curr));
+    int mask = (cls == cc_ident) ? SSE2IdentMask(v) : SSE2BlankMask(v);
+    unsigned long stop = ~mask & 0xFFFF;
+    if (stop) {
+      unsigned long ix;
+      _BitScanForward(&ix, stop);
+      return curr + ix;
     }
+    curr += 16;
+  }
+#endif
+  auto& table = GetCharClassTable();
+  while ((curr != end) && (table.cls[static_cast<unsigned char>(*curr)] == cls))
+    ++curr;
+  return curr;
+}
 
-    if (point == 0) {
-      if (curr != range.End()) {
-        // End of the file, must only be at the end.
-        throw TokenizerException(path.Raw(), __LINE__, line);
-      }
-      if (str) {
-        // Incomplete token, unexpected EoF.
-        throw TokenizerException(path.Raw(), __LINE__, line);
-      }
+int CountBits(unsigned int v) {
+  v = v - ((v >> 1) & 0x55555555);
+  v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+  return (((v + (v >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+}
 
-    } else if ((point == 0x09) || (point == 0x0A) || (point == 0x20)) {
-      // tab (0x09) linefeed (0x0A) and space (0x20).
-      if (str) {
-        auto r = Range<char>(str, curr);
-        int scol = column - static_cast<int>(r.Size());
-        tv.push_back(CppToken(r, CppToken::string, line, scol));
-        str = nullptr;
-      }
+// Returns an upper bound of the number of tokens that TokenizeCpp() generates
+// for |range|, which is one per symbol plus one per identifier run plus the
+// sos and eos tokens. It is cheap enough to size the token vector exactly
+// instead of guessing and reallocating, which doubles the peak memory.
+size_t CountTokensUpperBound(const Range<char>& range) {
+  auto& table = GetCharClassTable();
+  const char* curr = range.Start();
+  const char* end = range.End();
+  size_t count = 2;
+  bool in_run = false;
+
+#if defined(PLEX_TOKENIZER_SSE2)
+  while ((end - curr) >= 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(curr));
+    unsigned int ident = SSE2IdentMask(v);
+    unsigned int other = (SSE2RangeMask(v, 0x21, 0x7E) & ~ident) | _mm_movemask_epi8(v);
+    unsigned int run_starts = ident & ~((ident << 1) | (in_run ? 1 : 0));
+    count += CountBits(other) + CountBits(run_starts);
+    in_run = (ident & 0x8000) != 0;
+    curr += 16;
+  }
+#endif
+  for (; curr != end; ++curr) {
+    auto cls = table.cls[static_cast<unsigned char>(*curr)];
+    if (cls == cc_ident) {
+      if (!in_run)
+        ++count;
+      in_run = true;
+    } else {
+      if ((cls == cc_symbol) || (cls == cc_non_ascii))
+        ++count;
+      in_run = false;
+    }
+  }
+  return count;
+}
+
+// Returns the end of the word (identifier run) that starts at |curr|.
+char* ScanWord(char* curr, char* end) {
+  auto& table = GetCharClassTable();
+  while (curr != end) {
+    auto cls = table.cls[static_cast<unsigned char>(*curr)];
+    if ((cls != cc_ident) && (cls != cc_non_ascii))
+      break;
+    ++curr;
+  }
+  return curr;
+}
+
+// |curr| is just past a '#' that starts a line. If the line is "#if 0" returns
+// the end of the word that closes the region, or nullptr if the region is not
+// closed or this is not an #if 0. The rules are those of the lexer's token walk:
+// a '#' anywhere followed by if, ifdef or ifndef opens and followed by endif or
+// else closes, so the byte scan finds exactly the same end.
+char* ScanDisabledRegion(char* curr, char* end) {
+  auto& table = GetCharClassTable();
+  const Range<const char> words[] = { "if", "0" };
+  for (auto& word : words) {
+    curr = ScanCharClassRun(curr, end, cc_blank);
+    char* word_end = ScanWord(curr, end);
+    if (!Range<char>(curr, word_end).Equal(word))
+      return nullptr;
+    curr = word_end;
+  }
+
+  int if_count = 1;
+  while (curr != end) {
+    auto hash = static_cast<char*>(memchr(curr, '#', end - curr));
+    if (!hash)
+      return nullptr;
+    curr = hash + 1;
+    while ((curr != end) && ((table.cls[static_cast<unsigned char>(*curr)] == cc_blank) ||
+                             (table.cls[static_cast<unsigned char>(*curr)] == cc_newline)))
+      ++curr;
+    char* word_end = ScanWord(curr, end);
+    Range<char> word(curr, word_end);
+    if (word.Equal("endif") || word.Equal("else")) {
+      if (--if_count == 0)
+        return word_end;
+    } else if (word.Equal("if") || word.Equal("ifdef") || word.Equal("ifndef")) {
+      ++if_count;
+    }
+    curr = word_end;
+  }
+  return nullptr;
+}
+
+// Where the tokenizer is and what it needs to carry on from there.
+struct TokenizerState {
+  char* curr;
+  int line;
+  int column;
+  // Line of the last token, to tell if a '#' is the first token of its line.
+  int last_line;
+};
+
+// Tokenizes from |state.curr| until |stop| into |tv|. An #if 0 region can take
+// it past |stop|, up to the end of |range|, and |state| is left at the end.
+// Unless |skip_disabled| is false the #if 0 regions are not tokenized: the '#'
+// is followed by a single plex_disabled token that covers the rest of the region,
+// which the lexer turns into the same 'none' token it makes when it walks the
+// region token by token.
+void TokenizeRun(const FilePath& path, const Range<char>& range, char* stop,
+                 bool skip_disabled, TokenizerState& state, CppTokenVector& tv) {
+  auto& table = GetCharClassTable();
+  char* curr = state.curr;
+  char* const end = range.End();
+  char* str = nullptr;
+  const size_t first_token = tv.size();
+
+  int line = state.line;
+  int column = state.column;
+
+  auto PushString = [&tv, &line, &column](char* start, char* stop) {
+    auto r = Range<char>(start, stop);
+    int scol = column - static_cast<int>(r.Size());
+    tv.push_back(CppToken(r, CppToken::string, line, scol));
+  };
 
-      if (point == 0x0A) {
+  while (curr < stop) {
+    const unsigned char c = *curr;
+
+    switch (table.cls[c]) {
+      case cc_ident: {
+        // The whole run becomes (part of) a single string token.
+        if (!str)
+          str = curr;
+        auto run_end = ScanCharClassRun(curr + 1, stop, cc_ident);
+        column += static_cast<int>(run_end - curr);
+        curr = run_end;
+      }
+      continue;
+      case cc_blank: {
+        if (str) {
+          PushString(str, curr);
+          str = nullptr;
+        }
+        auto run_end = ScanCharClassRun(curr + 1, stop, cc_blank);
+        column += static_cast<int>(run_end - curr);
+        curr = run_end;
+      }
+      continue;
+      case cc_newline: {
+        if (str) {
+          PushString(str, curr);
+          str = nullptr;
+        }
+        if (column > CppToken::kMaxColumn)
+          throw TokenizerException(path.Raw(), __LINE__, line);
         ++line;
         column = 0;
       }
-
-    } else if ((point <  0x20) || (point == 0x7F)) {
-      // Nonprintables are unrecoberable erros.
-      throw TokenizerException(path.Raw(), __LINE__, line);
-    } else {
-      int symbol_type;
-      switch (point) {
-        case 0x21 :    // !
-        case 0x22 :    // "
-        case 0x23 :    // #
-        case 0x24 :    // $
-        case 0x25 :    // %
-        case 0x26 :    // &
-        case 0x27 :    // '
-        case 0x28 :    // (
-        case 0x29 :    // )
-        case 0x2A :    // *
-        case 0x2B :    // +
-        case 0x2C :    // ,
-        case 0x2D :    // -
-        case 0x2E :    // .
-        case 0x2F :    // /
-          symbol_type = CppToken::logical_not + (point - 0x21); break;
-        case 0x3A :    // :
-        case 0x3B :    // ;
-        case 0x3C :    // <
-        case 0x3D :    // =
-        case 0x3E :    // >
-        case 0x3F :    // ?
-        case 0x40 :    // @
-          symbol_type = CppToken::colon + (point - 0x3A); break;
-        case 0x5B :    // [
-        case 0x5C :    // backslash
-        case 0x5D :    // ]
-        case 0x5E :    // ^
-          symbol_type = CppToken::open_sqr_bracket + (point - 0x5B); break;
-        case 0x60 :    // `
-          symbol_type = CppToken::tilde; break;
-        case 0x7B :    // {
-        case 0x7C :    // |
-        case 0x7D :    // }
-        case 0x7E :    // ~
-          symbol_type = CppToken::open_cur_bracket + (point - 0x7B); break;
-        default:
-          // A-Z a-z 0-9 and _ (which is 0x5F)
-          symbol_type = 0;
-      };  // switch
-
-      if (symbol_type == 0) {
-         if (!str)
-            str = curr;
-      } else {
+      break;
+      case cc_symbol: {
         if (str) {
-          auto r = Range<char>(str, curr);
-          int scol = column - static_cast<int>(r.Size());
-          tv.push_back(CppToken(r, CppToken::string, line, scol));
+          PushString(str, curr);
           str = nullptr;
         }
-        tv.push_back(CppToken(Range<char>(curr, curr + 1), 
-                              static_cast<CppToken::Type>(symbol_type),
-                              line, column));
+        int prev_line = (tv.size() > first_token) ? tv.back().line() : state.last_line;
+        tv.push_back(CppToken(Range<char>(curr, curr + 1), table.symbol[c], line, column));
+        if ((c == '#') && skip_disabled && (prev_line != line)) {
+          char* region_end = ScanDisabledRegion(curr + 1, end);
+          if (region_end) {
+            tv.push_back(CppToken(Range<char>(curr + 1, region_end),
+                                  CppToken::plex_disabled, line, column + 1));
+            // Only the line accounting is done for the skipped bytes.
+            for (++curr, ++column; ; ) {
+              auto nl = static_cast<char*>(memchr(curr, '\n', region_end - curr));
+              if (!nl)
+                break;
+              column += static_cast<int>(nl - curr);
+              if (column > CppToken::kMaxColumn)
+                throw TokenizerException(path.Raw(), __LINE__, line);
+              ++line;
+              column = 1;
+              curr = nl + 1;
+            }
+            column += static_cast<int>(region_end - curr);
+            curr = region_end;
+            continue;
+          }
+        }
       }
+      break;
+      case cc_non_ascii: {
+        // Non ascii code points are accepted as part of a string token.
+        if (DecodeUTF8Point(curr, range) < 0)
+          throw TokenizerException(path.Raw(), __LINE__, line);
+        if (!str)
+          str = curr;
+      }
+      break;
+      default:
+        // Nonprintables (including 0) are unrecoberable erros.
+        throw TokenizerException(path.Raw(), __LINE__, line);
     }
 
-    c = range.Next(curr);
+    ++curr;
     ++column;
-  } while (curr);
+  }
+  // Note that a string token that runs until the end of the file is dropped.
+
+  state.curr = curr;
+  state.line = line;
+  state.column = column;
+  if (tv.size() > first_token)
+    state.last_line = tv.back().line();
+}
+
+// Files at least twice this size are tokenized in chunks when there are spare
+// threads. Set with --tokenize-chunk.
+size_t tokenize_chunk_size = 8 * 1024 * 1024;
+
+// Tokenizes |range| in chunks that start at line boundaries on up to |jobs|
+// threads. Each chunk is tokenized as if it was a file of its own, so the lines
+// are off by the lines before it and the chunk is wrong if the line boundary was
+// inside an #if 0 region. The chunks are then stitched in order: a chunk that
+// starts where the previous one ended is rebased and kept and otherwise the
+// tokens from where the previous one ended are redone with the right state. The
+// result is the same as that of a serial run. Returns false if a chunk failed,
+// which might be in bytes a serial run skips, so the caller can find out.
+bool TokenizeChunks(const FilePath& path, const Range<char>& range, bool skip_disabled,
+                    int jobs, CppTokenVector& tv) {
+  std::vector<char*> bounds(1, range.Start());
+  while (static_cast<size_t>(range.End() - bounds.back()) >= 2 * tokenize_chunk_size) {
+    auto split = bounds.back() + tokenize_chunk_size;
+    auto nl = static_cast<char*>(memchr(split, '\n', range.End() - split));
+    if (!nl)
+      break;
+    bounds.push_back(nl + 1);
+  }
+  bounds.push_back(range.End());
+
+  struct Chunk {
+    CppTokenVector tv;
+    TokenizerState state;
+  };
+  std::vector<Chunk> chunks(bounds.size() - 1);
+  try {
+    ParallelFor(chunks.size(), jobs, [&] (size_t ix) {
+      auto& chunk = chunks[ix];
+      chunk.tv.reserve(CountTokensUpperBound(Range<char>(bounds[ix], bounds[ix + 1])));
+      TokenizerState state = { bounds[ix], 1, 1, 0 };
+      TokenizeRun(path, range, bounds[ix + 1], skip_disabled, state, chunk.tv);
+      chunk.state = state;
+    });
+  } catch (TokenizerException&) {
+    return false;
+  }
+
+  TokenizerState state = { range.Start(), 1, 1, 0 };
+  std::vector<int> line_offsets(chunks.size(), 0);
+  size_t count = tv.size() + 1;
+  for (size_t ix = 0; ix != chunks.size(); ++ix) {
+    auto& chunk = chunks[ix];
+    if (state.curr == bounds[ix]) {
+      const int offset = state.line - 1;
+      line_offsets[ix] = offset;
+      state.curr = chunk.state.curr;
+      state.line = chunk.state.line + offset;
+      state.column = chunk.state.column;
+      if (!chunk.tv.empty())
+        state.last_line = chunk.tv.back().line() + offset;
+    } else {
+      // The previous chunk ended in this one, or past it.
+      CppTokenVector redo;
+      if (state.curr < bounds[ix + 1]) {
+        redo.reserve(CountTokensUpperBound(Range<char>(state.curr, bounds[ix + 1])));
+        TokenizeRun(path, range, bounds[ix + 1], skip_disabled, state, redo);
+      }
+      chunk.tv.swap(redo);
+    }
+    count += chunk.tv.size();
+  }
+
+  tv.reserve(count);
+  for (size_t ix = 0; ix != chunks.size(); ++ix) {
+    chunks[ix].tv.ShiftLines(line_offsets[ix]);
+    tv.append(chunks[ix].tv);
+    CppTokenVector().swap(chunks[ix].tv);
+  }
+  if (state.column > CppToken::kMaxColumn)
+    throw TokenizerException(path.Raw(), __LINE__, state.line);
+  tv.push_back(CppToken(Range<char>(), CppToken::eos, state.line + 1, 0));
+  return true;
+}
 
-  // Insert a final token to simplify further processing.
-  tv.push_back(CppToken(Range<char>(curr, curr), CppToken::eos, line + 1, 0));
+// Tokenizes |path| or |e_range| if given, see TokenizeRun(). Large inputs are
+// split across |jobs| threads.
+CppTokenVector TokenizeCpp(const FilePath& path, Range<char>* e_range = nullptr,
+                           bool skip_disabled = true, int jobs = 1) {
+  Range<char> range = e_range ? *e_range : LoadFileOnce(path);
+  ScopedTicks ticks(plex_counters.tokenize_ticks);
+  CppTokenVector tv;
+
+  // The first token is always (s)tart-(o)f-(s)stream.
+  tv.push_back(CppToken(Range<char>(range.Start(), range.Start()), CppToken::sos, 0, 0));
+  tv.front().set_kelems(RunArena().New<KeyElements>(path));
+
+  // TokenizeChunks() only adds tokens when it succeeds.
+  const bool chunked = (jobs > 1) && (range.Size() >= 2 * tokenize_chunk_size) &&
+                       TokenizeChunks(path, range, skip_disabled, jobs, tv);
+  if (!chunked) {
+    tv.reserve(CountTokensUpperBound(range));
+    TokenizerState state = { range.Start(), 1, 1, 0 };
+    TokenizeRun(path, range, range.End(), skip_disabled, state, tv);
+    if (state.column > CppToken::kMaxColumn)
+      throw TokenizerException(path.Raw(), __LINE__, state.line);
+    // Insert a final token to simplify further processing.
+    tv.push_back(CppToken(Range<char>(), CppToken::eos, state.line + 1, 0));
+  }
+
+  plex_counters.tokenize_bytes += range.Size();
+  plex_counters.tokenize_tokens += tv.size();
   return tv;
 }
 
-bool IsCppTokenNextTo(CppTokenVector::iterator it) {
-  const CppToken& next = *(it + 1);
-  return (it->range.End() == next.range.Start());
-}
+template <typename It>
+bool IsCppTokenNextTo(It it) {
+  auto next = *(it + 1);
+  return (it->range().End() == next.range().Start());
+}
+
+template <typename It>
+bool IsCppTokenNextTo(It it, CppToken::Type type) {
+  auto next = *(it + 1);
+  if (next.type() != type)
+    return false;
+  return IsCppTokenNextTo(it);
+}
+
+template <typename It>
+bool IsCppTokenChar(It it, char c) {
+  return ((it->range().Size() == 1) && (*it->range().Start() == c));
+}
+
+template <typename It>
+void CoaleseToken(It first, It last, CppToken::Type type) {
+  first->set_type(type);
+  first->set_range(Range<char>(first->range().Start(),
+                               last->range().End()));
+}
+
+// The lexer coalesces tokens as it goes, which erases the tokens right after the
+// one it is looking at. Erasing from a vector moves the whole tail every time and
+// made lexing quadratic in the file size, so the lexer works on this view of the
+// vector instead: erased tokens become a gap that travels along with the lexer
+// and the vector is compacted once, when the view goes away. Iterators are
+// logical indexes so |it - begin()| is the position the token ends up in.
+class LexTokenVector {
+public:
+  class iterator {
+    LexTokenVector* ltv_;
+    size_t ix_;
+
+    friend class LexTokenVector;
+
+  public:
+    iterator(LexTokenVector* ltv, size_t ix) : ltv_(ltv), ix_(ix) {}
+
+    CppTokenRef operator*() const { return *ltv_->At(ix_); }
+    CppTokenVector::iterator operator->() const { return ltv_->At(ix_); }
+
+    iterator& operator++() { ++ix_; return *this; }
+    iterator& operator--() { --ix_; return *this; }
+    iterator operator+(ptrdiff_t n) const { return iterator(ltv_, ix_ + n); }
+    iterator operator-(ptrdiff_t n) const { return iterator(ltv_, ix_ - n); }
+    ptrdiff_t operator-(const iterator& other) const { return ix_ - other.ix_; }
+
+    bool operator==(const iterator& other) const { return ix_ == other.ix_; }
+    bool operator!=(const iterator& other) const { return ix_ != other.ix_; }
+  };
+
+  explicit LexTokenVector(CppTokenVector& tv) : tv_(tv), gap_(0), gap_size_(0) {}
+
+  ~LexTokenVector() {
+    MoveGap(tv_.size() - gap_size_);
+    tv_.erase(tv_.end() - gap_size_, tv_.end());
+  }
+
+  iterator begin() { return iterator(this, 0); }
+  iterator end() { return iterator(this, tv_.size() - gap_size_); }
+
+  void erase(iterator first, iterator last) {
+    MoveGap(first.ix_);
+    gap_size_ += last.ix_ - first.ix_;
+  }
+
+  void erase(iterator pos) {
+    erase(pos, pos + 1);
+  }
+
+private:
+  CppTokenVector& tv_;
+  // The gap is |gap_size_| tokens at |gap_| in the vector.
+  size_t gap_;
+  size_t gap_size_;
+
+  CppTokenVector::iterator At(size_t ix) {
+    return tv_.begin() + ((ix < gap_) ? ix : ix + gap_size_);
+  }
+
+  // The lexer only steps back a couple of tokens, so moving the gap is
+  // amortized constant.
+  void MoveGap(size_t to) {
+    if (gap_size_) {
+      for (size_t ix = gap_; ix < to; ++ix)
+        tv_[ix] = tv_[ix + gap_size_];
+      for (size_t ix = gap_; ix > to; --ix)
+        tv_[ix + gap_size_ - 1] = tv_[ix - 1];
+    }
+    gap_ = to;
+  }
+
+  LexTokenVector(const LexTokenVector&);
+  LexTokenVector& operator=(const LexTokenVector&);
+};
+
+#pragma endregion
+
+#pragma region preprocessor
+
+// Macros that plex treats as defined when it evaluates #if conditions, from
+// --define=<name>[=<value>],... The plex.define properties of a file define
+// more names, to 1, from the point they appear.
+std::map<std::string, long long> plex_defines;
+
+// Identifies |plex_defines| in the token cache and in the incremental options.
+std::string DefinesKey() {
+  std::string key;
+  for (auto& d : plex_defines)
+    key += d.first + "=" + std::to_string(d.second) + ",";
+  return key;
+}
+
+// Evaluates the condition of an #if. The preprocessor takes any name it
+// doesn't know as 0, but plex can't: the name can come from the compiler or from
+// a header plex doesn't read. So what depends on a name that is not in the
+// defines evaluates to 'unknown' unless the result does not depend on it.
+class PPCondition {
+  const std::vector<std::string>& terms_;
+  const KeyElements& kelem_;
+  size_t ix_;
+  bool ok_;
+
+  struct Value {
+    bool known;
+    long long v;
+  };
+
+public:
+  enum Result { is_false, is_true, unknown };
+
+  PPCondition(const std::vector<std::string>& terms, const KeyElements& kelem)
+      : terms_(terms), kelem_(kelem), ix_(0), ok_(true) {}
+
+  Result Evaluate() {
+    auto value = Or();
+    if (!ok_ || (ix_ != terms_.size()) || !value.known)
+      return unknown;
+    return value.v ? is_true : is_false;
+  }
+
+  // The value of |name| if it is defined, to plex.
+  bool Lookup(const std::string& name, long long& value) const {
+    auto it = plex_defines.find(name);
+    if (it != end(plex_defines)) {
+      value = it->second;
+      return true;
+    }
+    auto pit = kelem_.properties.find("define");
+    if (pit == end(kelem_.properties))
+      return false;
+    if (std::find(begin(pit->second), end(pit->second), name) == end(pit->second))
+      return false;
+    value = 1;
+    return true;
+  }
+
+private:
+  const std::string& Peek() const {
+    static const std::string none;
+    return (ix_ < terms_.size()) ? terms_[ix_] : none;
+  }
+
+  bool Accept(const char* term) {
+    if (Peek() != term)
+      return false;
+    ++ix_;
+    return true;
+  }
+
+  Value Or() {
+    auto lhs = And();
+    while (Accept("||")) {
+      auto rhs = And();
+      if ((lhs.known && lhs.v) || (rhs.known && rhs.v))
+        lhs = Known(1);
+      else
+        lhs = Both(lhs, rhs, 0);
+    }
+    return lhs;
+  }
+
+  Value And() {
+    auto lhs = Compare();
+    while (Accept("&&")) {
+      auto rhs = Compare();
+      if ((lhs.known && !lhs.v) || (rhs.known && !rhs.v))
+        lhs = Known(0);
+      else
+        lhs = Both(lhs, rhs, 1);
+    }
+    return lhs;
+  }
+
+  Value Compare() {
+    auto lhs = Unary();
+    for (;;) {
+      auto op = Peek();
+      if ((op != "==") && (op != "!=") && (op != "<") && (op != ">") &&
+          (op != "<=") && (op != ">="))
+        return lhs;
+      ++ix_;
+      auto rhs = Unary();
+      long long v = (op == "==") ? (lhs.v == rhs.v) :
+                    (op == "!=") ? (lhs.v != rhs.v) :
+                    (op == "<")  ? (lhs.v < rhs.v) :
+                    (op == ">")  ? (lhs.v > rhs.v) :
+                    (op == "<=") ? (lhs.v <= rhs.v) : (lhs.v >= rhs.v);
+      lhs = Both(lhs, rhs, v);
+    }
+  }
+
+  Value Unary() {
+    if (Accept("!")) {
+      auto value = Unary();
+      value.v = !value.v;
+      return value;
+    }
+    return Primary();
+  }
+
+  Value Primary() {
+    if (Accept("(")) {
+      auto value = Or();
+      if (!Accept(")"))
+        ok_ = false;
+      return value;
+    }
+    if (Accept("defined")) {
+      const bool paren = Accept("(");
+      auto name = Peek();
+      ++ix_;
+      if (paren && !Accept(")"))
+        ok_ = false;
+      long long value;
+      return Lookup(name, value) ? Known(1) : Unknown();
+    }
+    auto term = Peek();
+    ++ix_;
+    if (term.empty()) {
+      ok_ = false;
+      return Unknown();
+    }
+    if ((term[0] >= '0') && (term[0] <= '9')) {
+      char* end;
+      auto value = strtoll(term.c_str(), &end, 0);
+      while ((*end == 'u') || (*end == 'U') || (*end == 'l') || (*end == 'L'))
+        ++end;
+      if (*end)
+        ok_ = false;
+      return Known(value);
+    }
+    if (::isalpha(term[0]) || (term[0] == '_')) {
+      long long value;
+      return Lookup(term, value) ? Known(value) : Unknown();
+    }
+    ok_ = false;
+    return Unknown();
+  }
 
-bool IsCppTokenNextTo(CppTokenVector::iterator it, CppToken::Type type) {
-  const CppToken& next = *(it + 1);
-  if (next.type != type)
-    return false;
-  return IsCppTokenNextTo(it);
-}
+  static Value Known(long long v) {
+    Value value = {true, v};
+    return value;
+  }
 
-bool IsCppTokenChar(CppTokenVector::iterator it, char c) {
-  return ((it->range.Size() == 1) && (*it->range.Start() == c));
-}
+  static Value Unknown() {
+    Value value = {false, 0};
+    return value;
+  }
 
-void CoaleseToken(CppTokenVector::iterator first,
-                  CppTokenVector::iterator last,
-                  CppToken::Type type) {
-  first->type = type;
-  first->range = Range<char>(first->range.Start(),
-                                last->range.End());
-}
+  static Value Both(const Value& lhs, const Value& rhs, long long v) {
+    return (lhs.known && rhs.known) ? Known(v) : Unknown();
+  }
+};
 
 #pragma endregion
 
@@ -1396,40 +3192,130 @@ enum LexMode {
   PlexCPP,
 };
 
-bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
+// Returns false if a string or an alignas runs into a region skipped by the
+// tokenizer, which means that the '#' was not a directive. The tokens are left
+// half lexed and the file has to be tokenized again without skipping.
+bool LexCppTokens(LexMode mode, CppTokenVector& tv) {
+  ScopedTicks ticks(plex_counters.lex_ticks);
+  plex_counters.lex_tokens += tv.size();
+  LexTokenVector tokens(tv);
   auto it = tokens.begin();
-  if (it->type != CppToken::sos)
+  if (it->type() != CppToken::sos)
     throw PlexException(__LINE__, "No SOS in tokens stream");
 
-  KeyElements& kelem = *(it->kelems);
+  KeyElements& kelem = *(it->kelems());
   std::vector<ScopeBlock> scopes;
   auto path = kelem.src_path.Raw();
 
   size_t last_include_pos = 0;
 
+  // The '#' that starts the branches after the one kept by a resolved #if, and
+  // the '#' of its #endif. They are dropped when the loop gets there.
+  std::vector<std::pair<const char*, const char*>> drops;
+
+  // The terms of the directive at |hash|, with the two char operators merged. A
+  // trailing line comment is not part of the condition.
+  auto DirectiveTerms = [](LexTokenVector::iterator hash) -> std::vector<std::string> {
+    std::vector<std::string> terms;
+    const char* last_end = nullptr;
+    for (auto t = hash + 2; t->line() == hash->line(); ++t) {
+      if ((t->type() == CppToken::fwd_slash) && IsCppTokenNextTo(t, CppToken::fwd_slash))
+        break;
+      auto term = ToString(*t);
+      if (!terms.empty() && (last_end == t->range().Start()) &&
+          (terms.back().size() == 1) && (term.size() == 1)) {
+        auto op = terms.back() + term;
+        if ((op == "&&") || (op == "||") || (op == "==") || (op == "!=") ||
+            (op == "<=") || (op == ">=")) {
+          terms.back() = op;
+          last_end = t->range().End();
+          continue;
+        }
+      }
+      terms.push_back(term);
+      last_end = t->range().End();
+    }
+    return terms;
+  };
+
+  // Whether the branch of the #if, #ifdef, #ifndef or #else at |hash| is taken.
+  auto BranchCondition = [&](LexTokenVector::iterator hash) -> PPCondition::Result {
+    auto kind = hash + 1;
+    if (EqualToStr(*kind, "else"))
+      return PPCondition::is_true;
+    auto terms = DirectiveTerms(hash);
+    PPCondition cond(terms, kelem);
+    if (EqualToStr(*kind, "ifdef") || EqualToStr(*kind, "ifndef")) {
+      long long value;
+      if ((terms.size() != 1) || !cond.Lookup(terms[0], value))
+        return PPCondition::unknown;
+      return EqualToStr(*kind, "ifdef") ? PPCondition::is_true : PPCondition::is_false;
+    }
+    return cond.Evaluate();
+  };
+
+  // Whether the #if 0 region that the tokenizer skipped at |region| ends in an
+  // #else, so that its #endif is still ahead.
+  auto EndsInElse = [](const Range<char>& region) -> bool {
+    return Range<char>(region.End() - 4, region.End()).Equal("else");
+  };
+
+  // The '#' of the #else of the conditional group that continues at |start|, if
+  // any, followed by the '#' of its #endif.
+  auto FindBranches = [&](LexTokenVector::iterator start) {
+    std::vector<LexTokenVector::iterator> branches;
+    int depth = 0;
+    for (auto b = start; b->type() != CppToken::eos; ++b) {
+      if ((b->type() != CppToken::hash) || ((b - 1)->line() == b->line()))
+        continue;
+      auto kind = b + 1;
+      if (kind->type() == CppToken::plex_disabled) {
+        if (EndsInElse(kind->range()))
+          ++depth;
+        continue;
+      }
+      if (EqualToStr(*kind, "if") || EqualToStr(*kind, "ifdef") || EqualToStr(*kind, "ifndef")) {
+        ++depth;
+      } else if (EqualToStr(*kind, "endif")) {
+        if (!depth) {
+          branches.push_back(b);
+          return branches;
+        }
+        --depth;
+      } else if (!depth && EqualToStr(*kind, "else")) {
+        branches.push_back(b);
+      }
+    }
+    throw TokenizerException(path, __LINE__, start->line());
+  };
+
   while (it != tokens.end()) {
-    if ((it->type > CppToken::symbols_begin ) && (it->type < CppToken::symbols_end)) {
-      switch (it->type) {
+    if ((it->type() > CppToken::symbols_begin ) && (it->type() < CppToken::symbols_end)) {
+      switch (it->type()) {
         case CppToken::double_quote : {
           // Handle coalesing all tokens inside a string.
           auto it2 = it + 1;
 
-          if (IsCppTokenChar(it - 1, 'R') && (it + 1)->type == CppToken::open_paren) {
+          if (IsCppTokenChar(it - 1, 'R') && (it + 1)->type() == CppToken::open_paren) {
             // c++11 raw string, basic case only.
-            while (it2->type != CppToken::close_paren) {
-              if (it2->type == CppToken::eos)
-                throw TokenizerException(path, __LINE__, it2->line);
+            while (it2->type() != CppToken::close_paren) {
+              if (it2->type() == CppToken::eos)
+                throw TokenizerException(path, __LINE__, it2->line());
+              if (it2->type() == CppToken::plex_disabled)
+                return false;
               ++it2;
             }
-            if ((++it2)->type != CppToken::double_quote)
-              throw TokenizerException(path, __LINE__, it2->line);
+            if ((++it2)->type() != CppToken::double_quote)
+              throw TokenizerException(path, __LINE__, it2->line());
           } else {
             // classic c string.
-            while (it2->type != CppToken::double_quote) {
-              if (it2->type == CppToken::eos)
-                throw TokenizerException(path, __LINE__, it2->line);
+            while (it2->type() != CppToken::double_quote) {
+              if (it2->type() == CppToken::eos)
+                throw TokenizerException(path, __LINE__, it2->line());
+              if (it2->type() == CppToken::plex_disabled)
+                return false;
 
-              if (it2->type == CppToken::backlash) 
+              if (it2->type() == CppToken::backlash) 
                 ++it2;
               ++it2; 
             }
@@ -1449,10 +3335,10 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
         case CppToken::single_quote : {
           // Handle coalesing all tokens inside a string.
           auto it2 = it + 1;
-          while (*it2->range.Start() != '\'') {
-            if (it2->line != it->line)
-              throw TokenizerException(path, __LINE__, it->line);
-            if (*it2->range.Start() == '\\')
+          while (*it2->range().Start() != '\'') {
+            if (it2->line() != it->line())
+              throw TokenizerException(path, __LINE__, it->line());
+            if (*it2->range().Start() == '\\')
               ++it2;
             ++it2; 
           }
@@ -1469,20 +3355,48 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
         break;
         case CppToken::hash : {
           // Handle coalesing all tokens in a preprocessor or pragma line.
-          if ((it - 1)->line == it->line) {
+          if ((it - 1)->line() == it->line()) {
             // can't have tokens before a # in the same line.
-            throw TokenizerException(path, __LINE__, it->line);
+            throw TokenizerException(path, __LINE__, it->line());
+          }
+          if (!drops.empty() && (it->range().Start() == drops.back().first)) {
+            // The branches that a resolved #if did not keep, through its #endif.
+            auto it2 = it;
+            while (it2->range().Start() != drops.back().second) {
+              if (it2->type() == CppToken::eos)
+                throw TokenizerException(path, __LINE__, it->line());
+              ++it2;
+            }
+            const int endif_line = it2->line();
+            while (it2->line() == endif_line) {
+              ++it2;
+            }
+            drops.pop_back();
+            CoaleseToken(it, it2 - 1, CppToken::none);
+            tokens.erase(it + 1, it2);
+            break;
+          }
+          if ((it + 1)->type() == CppToken::plex_disabled) {
+            // An #if 0 region that the tokenizer skipped. If it ends in an #else
+            // then its #endif goes as well.
+            if (EndsInElse((it + 1)->range())) {
+              auto endif = FindBranches(it + 2).back()->range().Start();
+              drops.push_back(std::make_pair(endif, endif));
+            }
+            CoaleseToken(it, it + 1, CppToken::none);
+            tokens.erase(it + 1);
+            break;
           }
           
           // Next token is the kind.
           auto it2 = it + 1;
-          auto pp_type = GetCppPreprocessorKeyword(it2->range);
+          auto pp_type = GetCppPreprocessorKeyword(it2->range());
           if (pp_type == CppToken::unknown) {
             // unrecongized preprocessor directive;
-            throw TokenizerException(path, __LINE__, it->line);
+            throw TokenizerException(path, __LINE__, it->line());
           }
           int count = 0;
-          while (it2->line == it->line) {
+          while (it2->line() == it->line()) {
             ++it2; ++count;
           }
           // $$$ need to handle the 'null directive' which is a # in a single line.         
@@ -1492,28 +3406,28 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
               do {
                 // Try to parse "comment(user, "x.y=z")". This creates a map[y] = z
                 // entry in KeyElements for global plex properties (directives).
-                if ((++pit)->type != CppToken::open_paren) break;
+                if ((++pit)->type() != CppToken::open_paren) break;
                 if (!EqualToStr(*(++pit), "user")) break;
-                if ((++pit)->type != CppToken::comma) break;
-                if ((++pit)->type != CppToken::double_quote) break;
+                if ((++pit)->type() != CppToken::comma) break;
+                if ((++pit)->type() != CppToken::double_quote) break;
                 if (!EqualToStr(*(++pit), "plex")) break;
-                if ((++pit)->type != CppToken::period) break;
-                if ((++pit)->type != CppToken::string) break;
+                if ((++pit)->type() != CppToken::period) break;
+                if ((++pit)->type() != CppToken::string) break;
                 std::string key(ToString(*pit));
-                if ((++pit)->type != CppToken::equal) break;
-                if ((++pit)->type != CppToken::string) break;
+                if ((++pit)->type() != CppToken::equal) break;
+                if ((++pit)->type() != CppToken::string) break;
                 kelem.properties[key].push_back(ToString(*pit));
-                if ((++pit)->type != CppToken::double_quote)
-                  throw TokenizerException(path, __LINE__, it->line);
+                if ((++pit)->type() != CppToken::double_quote)
+                  throw TokenizerException(path, __LINE__, it->line());
               } while (false);
             }
           } else if (pp_type == CppToken::prep_include) {
             if (count < 4)
-              throw TokenizerException(path, __LINE__, it->line);
+              throw TokenizerException(path, __LINE__, it->line());
             //Includes go into a special map.
-            Range<char> irange((it + 2)->range.Start(), (it2 - 1)->range.End());
+            Range<char> irange((it + 2)->range().Start(), (it2 - 1)->range().End());
             if ((irange[0] != '"') && (irange[0] != '<'))
-              throw TokenizerException(path, __LINE__, it->line);
+              throw TokenizerException(path, __LINE__, it->line());
             auto item_pos = it - tokens.begin();
             if (kelem.includes.empty())
               kelem.includes[Range<char>(first_include_key)] = item_pos;
@@ -1521,31 +3435,35 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
             last_include_pos = item_pos;
             kelem.includes[irange] = item_pos;
             
-          } else if (pp_type == CppToken::prep_if) {
-            auto if_it = it + 2;
-            if (EqualToStr(*if_it, "0")) {
-              // Found an #if 0. Find the matching #endif.
-              int if_count = 1;
-              ++if_it;
-              while ((if_it->type != CppToken::eos) && (if_count > 0)) {
-                if (EqualToStr(*if_it, "endif") && (if_it -1)->type == CppToken::hash)
-                  --if_count;
-                else if (EqualToStr(*if_it, "else") && (if_it -1)->type == CppToken::hash)
-                  --if_count;
-                else if (EqualToStr(*if_it, "if") && (if_it -1)->type == CppToken::hash)
-                  ++if_count;
-                else if (EqualToStr(*if_it, "ifdef") && (if_it -1)->type == CppToken::hash)
-                  ++if_count;
-                else if (EqualToStr(*if_it, "ifndef") && (if_it -1)->type == CppToken::hash)
-                  ++if_count;
-                ++if_it;
+          } else if ((pp_type == CppToken::prep_if) ||
+                     (pp_type == CppToken::prep_ifdef) ||
+                     (pp_type == CppToken::prep_ifndef)) {
+            // When plex can tell which branch is taken, the directives up to it
+            // become a 'none' token here, and the other branches are dropped later.
+            auto cond = BranchCondition(it);
+            if (cond != PPCondition::unknown) {
+              auto branches = FindBranches(it2);
+              auto start = it;
+              size_t ix = 0;
+              while ((cond == PPCondition::is_false) && (ix + 1 < branches.size())) {
+                start = branches[ix++];
+                cond = BranchCondition(start);
+              }
+              if (cond == PPCondition::is_true) {
+                drops.push_back(std::make_pair(branches[ix]->range().Start(),
+                                               branches.back()->range().Start()));
+              } else if (cond == PPCondition::is_false) {
+                // No branch is taken.
+                start = branches.back();
+              }
+              if (cond != PPCondition::unknown) {
+                it2 = start + 1;
+                while (it2->line() == start->line()) {
+                  ++it2;
+                }
+                pp_type = CppToken::none;
               }
-              if (if_count != 0)
-                throw TokenizerException(path, __LINE__, it->line);
-              // Erase all the tokens by marking them as 'none' type.
-              it2 = if_it;
-              pp_type = CppToken::none;
-            }  // #if 0.
+            }
           }
 
           CoaleseToken(it, it2 - 1, pp_type);
@@ -1561,32 +3479,32 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
           auto block_type = ScopeBlock::block_other;
           Range<char> name;
 
-          if (it2->type == CppToken::kw_namespace) {
+          if (it2->type() == CppToken::kw_namespace) {
             block_type = ScopeBlock::anons_namespace;
-          } else if (it2->type == CppToken::semicolon) {
+          } else if (it2->type() == CppToken::semicolon) {
             block_type = ScopeBlock::block_scope;
-          } else if (it2->type == CppToken::identifier) {
+          } else if (it2->type() == CppToken::identifier) {
             auto it3 = it2 - 1;
-            name = it2->range;
+            name = it2->range();
 
-            if (it3->type == CppToken::kw_alignas) {
+            if (it3->type() == CppToken::kw_alignas) {
               it3 = it3 - 1;
             }
 
-            if (it3->type == CppToken::kw_namespace)
+            if (it3->type() == CppToken::kw_namespace)
               block_type = ScopeBlock::named_namespace;
-            else if ((it3->type == CppToken::kw_class)   ||
-                     (it3->type == CppToken::kw_public)  ||
-                     (it3->type == CppToken::kw_private) ||
-                     (it3->type == CppToken::kw_struct)  ||
-                     (it3->type == CppToken::kw_union))
+            else if ((it3->type() == CppToken::kw_class)   ||
+                     (it3->type() == CppToken::kw_public)  ||
+                     (it3->type() == CppToken::kw_private) ||
+                     (it3->type() == CppToken::kw_struct)  ||
+                     (it3->type() == CppToken::kw_union))
               block_type = ScopeBlock::block_aggregate;
-            else if (it3->type == CppToken::kw_enum)
+            else if (it3->type() == CppToken::kw_enum)
               block_type = ScopeBlock::block_enum;
-            else if (it3->type == CppToken::deref_ptr)
+            else if (it3->type() == CppToken::deref_ptr)
               block_type = ScopeBlock::block_scope;
             else
-              throw TokenizerException(path, __LINE__, it->line);
+              throw TokenizerException(path, __LINE__, it->line());
           }
           auto top = scopes.empty() ? 0 : scopes.back().start;
           scopes.push_back(ScopeBlock(block_type, name, pos, top));
@@ -1594,7 +3512,7 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
         break;
         case CppToken::close_cur_bracket : {
           if (scopes.empty())
-            throw TokenizerException(path, __LINE__, it->line);
+            throw TokenizerException(path, __LINE__, it->line());
           auto cs = scopes.back();
           cs.end = (it - tokens.begin());
           kelem.scopes.push_back(cs);
@@ -1610,13 +3528,13 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
 
             if (tt_type == CppToken::line_comment) {
               auto it2 = it + 1;
-              while (it2->line == it->line) { ++it2; }
+              while (it2->line() == it->line()) { ++it2; }
               CoaleseToken(it, it2 -1, CppToken::comment);
               tokens.erase(it + 1, it2);
               if (mode == LexMode::PlexCPP) {
-                if (it->range.Size() > 3) {
-                  if ((it->range[2] == '#') && (it->range[3] == '~')) {
-                    it->type = CppToken::plex_comment;
+                if (it->range().Size() > 3) {
+                  if ((it->range()[2] == '#') && (it->range()[3] == '~')) {
+                    it->set_type(CppToken::plex_comment);
                     kelem.plex_comments.push_back(ToString(*it));
                   }
                 }
@@ -1624,10 +3542,10 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
             } else {
               // Here we handle the two three-char cases: >>= and <<=.
               if (IsCppTokenNextTo(it, CppToken::eq)) {
-                if (it->type == CppToken::left_shift) {
+                if (it->type() == CppToken::left_shift) {
                   CoaleseToken(it, it + 1, CppToken::ass_left_shift);
                   tokens.erase(it + 1);
-                } else if (it->type == CppToken::right_shift) {
+                } else if (it->type() == CppToken::right_shift) {
                   CoaleseToken(it, it + 1, CppToken::ass_right_shift);
                   tokens.erase(it + 1);
                 }
@@ -1636,18 +3554,20 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
           }
         }
       }  // switch
-    } else if (it->type == CppToken::string) {
-      CppToken::Type type = GetCppKeywordType(it->range);
+    } else if (it->type() == CppToken::string) {
+      CppToken::Type type = GetCppKeywordType(it->range());
       if (type != CppToken::unknown) {
-        it->type = type;
+        it->set_type(type);
 
         if (type == CppToken::kw_alignas) {
           auto it2 = it + 1;
-          if (it2->type != CppToken::open_paren)
-            throw TokenizerException(path, __LINE__, it->line);
-          while (it2->type != CppToken::close_paren) {
-            if (it2->type == CppToken::eos)
-              throw TokenizerException(path, __LINE__, it->line);
+          if (it2->type() != CppToken::open_paren)
+            throw TokenizerException(path, __LINE__, it->line());
+          while (it2->type() != CppToken::close_paren) {
+            if (it2->type() == CppToken::eos)
+              throw TokenizerException(path, __LINE__, it->line());
+            if (it2->type() == CppToken::plex_disabled)
+              return false;
             ++it2;
           }
           CoaleseToken(it, it2, CppToken::kw_alignas);
@@ -1655,7 +3575,7 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
         }
 
       } else {
-        const char c = *it->range.Start();
+        const char c = *it->range().Start();
         if ((c >= '0') && (c <= '9')) {
           // possible numeric constant. Being it relatively rare we can use iostream.
           std::string number(ToString(*it));
@@ -1664,7 +3584,7 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
           long long s_value;
           ss >> s_value;
           if (!ss)
-            throw TokenizerException(path, __LINE__, it->line);
+            throw TokenizerException(path, __LINE__, it->line());
           size_t np = ss.tellg();
           if (np != ~0ULL) {
             // failed to fully consume the number. See if we have a
@@ -1674,7 +3594,7 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
               case 'E' : {
                 // Mantissa + exponent form. 'e' must be the last char.
                 if ((np + 1) != number.size())
-                  throw TokenizerException(path, __LINE__, it->line);
+                  throw TokenizerException(path, __LINE__, it->line());
               }
               break;
               case 'x' :
@@ -1683,7 +3603,7 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
                 ss.seekg(0);
                 ss >> std::hex >> u_value;
                 if (!ss)
-                  throw TokenizerException(path, __LINE__, it->line);
+                  throw TokenizerException(path, __LINE__, it->line());
                 np = ss.tellg();
                 if ((np > 1) && (np != ~0ULL)) {
                   switch (number[np]) {
@@ -1693,7 +3613,7 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
                     case 'U':
                       break;
                     default:
-                      throw TokenizerException(path, __LINE__, it->line);
+                      throw TokenizerException(path, __LINE__, it->line());
                   }
                 }
               }
@@ -1706,41 +3626,41 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
               case 'u' :
               case 'U' : break;
               default:
-                throw TokenizerException(path, __LINE__, it->line);
+                throw TokenizerException(path, __LINE__, it->line());
             }
           }
           // ok, it seems to be a number. See if we can coalease with + - or .
-          if ((it - 1)->type == CppToken::minus ||
-              (it - 1)->type == CppToken::plus ||
-              (it - 1)->type == CppToken::period) {
+          if ((it - 1)->type() == CppToken::minus ||
+              (it - 1)->type() == CppToken::plus ||
+              (it - 1)->type() == CppToken::period) {
             it = it - 1;
             CoaleseToken(it, it + 1, CppToken::const_number);
             tokens.erase(it + 1);
           } else {
-            it->type = CppToken::const_number;
+            it->set_type(CppToken::const_number);
           }
           // If the previous token was a number, then we can coalese it as well
-          if ((it - 1)->type == CppToken::const_number) {
+          if ((it - 1)->type() == CppToken::const_number) {
             it = it - 1;
             CoaleseToken(it, it + 1, CppToken::const_number);
             tokens.erase(it + 1);
           }
 
         } else if (::isalpha(c) || (c == '_')) {
-          if (IsPredefinedMacro(it->range)) {
-            it->type = CppToken::predef_macro;
+          if (IsPredefinedMacro(it->range())) {
+            it->set_type(CppToken::predef_macro);
 
           } else {
             // identifier.
-            it->type = CppToken::identifier;
+            it->set_type(CppToken::identifier);
 
             // handle the case of a qualified name, first the global scope.
-            if ((it - 1)->type == CppToken::name_scope) {
+            if ((it - 1)->type() == CppToken::name_scope) {
               it = it - 1;
               CoaleseToken(it, it + 1, CppToken::identifier);
               tokens.erase(it + 1);
               // and secondly the fully qualified case.
-              if ((it - 1)->type == CppToken::identifier) {
+              if ((it - 1)->type() == CppToken::identifier) {
                 it = it - 1;
                 CoaleseToken(it, it + 1, CppToken::identifier);
                 tokens.erase(it + 1);
@@ -1749,20 +3669,23 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
           }
 
         } else {
-          throw TokenizerException(path, __LINE__, it->line);
+          throw TokenizerException(path, __LINE__, it->line());
         }
       }
-    } else if (it->type == CppToken::sos) {
+    } else if (it->type() == CppToken::sos) {
       // first token.
-    } else if (it->type == CppToken::eos) {
+    } else if (it->type() == CppToken::eos) {
+      if (!drops.empty())
+        throw TokenizerException(path, __LINE__, 0);
       if (last_include_pos)
         kelem.includes[Range<char>(last_include_key)] = last_include_pos;
       // The scopes vector should be empty or else we have an unbalanced "{".
       if (!scopes.empty())
         throw TokenizerException(path, __LINE__, 0);
+      kelem.IndexScopes();
       return true;
     } else {
-      throw TokenizerException(path, __LINE__, it->line);
+      throw TokenizerException(path, __LINE__, it->line());
     }
     // advance to next token.
     ++it;
@@ -1771,6 +3694,351 @@ bool LexCppTokens(LexMode mode, CppTokenVector& tokens) {
   throw TokenizerException(path, __LINE__, 0);
 }
 
+CppTokenVector TokenizeAndLexCpp(const FilePath& path, LexMode mode,
+                                 Range<char>* e_range = nullptr, int jobs = 1) {
+  auto tv = TokenizeCpp(path, e_range, true, jobs);
+  if (!LexCppTokens(mode, tv)) {
+    tv = TokenizeCpp(path, e_range, false, jobs);
+    LexCppTokens(mode, tv);
+  }
+  return tv;
+}
+
+#pragma region token_cache
+
+// Identifies this plex build. Any change to plex can change its outputs.
+uint64_t PlexBuildStamp() {
+  std::string stamp = std::string(plex_version) + " " __DATE__ " " __TIME__;
+  return HashFNV1a(FromString(stamp));
+}
+
+// On-disk cache of lexed token vectors, one file per distinct source content.
+// The file name is the FNV-1a hash of the source bytes and the header also
+// records the plex build so a new plex binary never reads stale entries.
+//
+// Layout: TokenCacheHeader, token_count TokenRecords and then the KeyElements
+// section. Token and scope ranges are stored as offsets into the source.
+class TokenCache {
+  FilePath dir_;
+
+  static const uint32_t kFormat = 2;
+  static const uint32_t kNullOffset = 0xFFFFFFFF;
+  static const uint32_t kFirstIncludeKey = 0xFFFFFFFE;
+  static const uint32_t kLastIncludeKey = 0xFFFFFFFD;
+
+  struct TokenCacheHeader {
+    char magic[4];
+    uint32_t format;
+    uint64_t plex_stamp;
+    uint64_t defines_hash;
+    uint64_t content_hash;
+    uint64_t content_size;
+    uint32_t mode;
+    uint32_t token_count;
+  };
+
+  struct TokenRecord {
+    uint32_t offset;
+    uint32_t size;
+    int32_t line;
+    int32_t col;
+    uint32_t type;
+  };
+
+  // The lexed tokens depend on the --define macros.
+  static uint64_t DefinesHash() {
+    auto key = DefinesKey();
+    return HashFNV1a(FromString(key));
+  }
+
+  // Bounds checked sequential reads over the mapped cache file.
+  class Reader {
+    const char* curr_;
+    const char* end_;
+    bool ok_;
+
+  public:
+    Reader(const char* start, const char* end) : curr_(start), end_(end), ok_(true) {}
+
+    bool ok() const { return ok_; }
+
+    const char* Take(size_t size) {
+      if (!ok_ || (static_cast<size_t>(end_ - curr_) < size)) {
+        ok_ = false;
+        return nullptr;
+      }
+      auto r = curr_;
+      curr_ += size;
+      return r;
+    }
+
+    template <typename T>
+    T Pod() {
+      T v = T();
+      auto p = Take(sizeof(T));
+      if (p)
+        memcpy(&v, p, sizeof(T));
+      return v;
+    }
+
+    std::string Str() {
+      auto size = Pod<uint32_t>();
+      auto p = Take(size);
+      return p ? std::string(p, size) : std::string();
+    }
+  };
+
+public:
+  explicit TokenCache(const FilePath& dir) : dir_(dir) {
+    if (!::CreateDirectoryW(dir_.Raw(), NULL)) {
+      if (::GetLastError() != ERROR_ALREADY_EXISTS)
+        throw IOException(__LINE__, dir_.Raw());
+    }
+  }
+
+  // Fills |tv| from the cache entry for |src|. Returns false if there is no
+  // valid entry, in which case |tv| is left untouched.
+  bool Load(const FilePath& path, const Range<char>& src, LexMode mode, CppTokenVector& tv) {
+    auto hash = HashFNV1a(src);
+    File file = File::Create(EntryPath(hash), FileParams::ReadSharedRead(), FileSecurity());
+    if (!file.IsValid())
+      return false;
+    if (file.SizeInBytes() < sizeof(TokenCacheHeader))
+      return false;
+
+    auto view = FileView::Create(file, 0, 0, nullptr);
+    Reader reader(view.Start(), view.End());
+
+    auto header = reader.Pod<TokenCacheHeader>();
+    if ((memcmp(header.magic, "PXTC", 4) != 0) ||
+        (header.format != kFormat) ||
+        (header.plex_stamp != PlexBuildStamp()) ||
+        (header.defines_hash != DefinesHash()) ||
+        (header.content_hash != hash) ||
+        (header.content_size != src.Size()) ||
+        (header.mode != mode))
+      return false;
+
+    auto records = reinterpret_cast<const TokenRecord*>(
+        reader.Take(header.token_count * sizeof(TokenRecord)));
+    if (!records)
+      return false;
+
+    CppTokenVector ctv;
+    ctv.reserve(header.token_count);
+    for (uint32_t ix = 0; ix != header.token_count; ++ix) {
+      auto& rec = records[ix];
+      Range<char> range;
+      if (!ToRange(src, rec.offset, rec.size, range))
+        return false;
+      ctv.push_back(CppToken(range, static_cast<CppToken::Type>(rec.type), rec.line, rec.col));
+    }
+    if (ctv.empty() || (ctv[0].type() != CppToken::sos))
+      return false;
+
+    auto kelems = RunArena().New<KeyElements>(path);
+
+    auto include_count = reader.Pod<uint32_t>();
+    for (uint32_t ix = 0; reader.ok() && (ix != include_count); ++ix) {
+      auto offset = reader.Pod<uint32_t>();
+      auto size = reader.Pod<uint32_t>();
+      auto pos = reader.Pod<uint64_t>();
+      Range<char> key;
+      if (offset == kFirstIncludeKey)
+        key = Range<char>(first_include_key);
+      else if (offset == kLastIncludeKey)
+        key = Range<char>(last_include_key);
+      else if (!ToRange(src, offset, size, key))
+        return false;
+      kelems->includes[key] = static_cast<size_t>(pos);
+    }
+
+    auto scope_count = reader.Pod<uint32_t>();
+    for (uint32_t ix = 0; reader.ok() && (ix != scope_count); ++ix) {
+      auto type = reader.Pod<uint32_t>();
+      auto offset = reader.Pod<uint32_t>();
+      auto size = reader.Pod<uint32_t>();
+      auto top = reader.Pod<uint64_t>();
+      auto start = reader.Pod<uint64_t>();
+      auto end = reader.Pod<uint64_t>();
+      Range<char> name;
+      if (!ToRange(src, offset, size, name))
+        return false;
+      ScopeBlock sb(static_cast<ScopeBlock::Type>(type), name,
+                    static_cast<size_t>(start), static_cast<size_t>(top));
+      sb.end = static_cast<size_t>(end);
+      kelems->scopes.push_back(sb);
+    }
+
+    auto property_count = reader.Pod<uint32_t>();
+    for (uint32_t ix = 0; reader.ok() && (ix != property_count); ++ix) {
+      auto& values = kelems->properties[reader.Str()];
+      auto value_count = reader.Pod<uint32_t>();
+      for (uint32_t iy = 0; reader.ok() && (iy != value_count); ++iy)
+        values.push_back(reader.Str());
+    }
+
+    auto comment_count = reader.Pod<uint32_t>();
+    for (uint32_t ix = 0; reader.ok() && (ix != comment_count); ++ix)
+      kelems->plex_comments.push_back(reader.Str());
+
+    if (!reader.ok())
+      return false;
+
+    kelems->IndexScopes();
+    ctv[0].set_kelems(kelems);
+    tv.swap(ctv);
+    return true;
+  }
+
+  // Writes the cache entry for |src|. Tokens that don't point inside |src| can't
+  // be cached and in that case nothing is written.
+  void Store(const Range<char>& src, LexMode mode, const CppTokenVector& tv) {
+    auto hash = HashFNV1a(src);
+    std::string buf;
+
+    TokenCacheHeader header = {{'P', 'X', 'T', 'C'}, kFormat, PlexBuildStamp(),
+                               DefinesHash(), hash, src.Size(), static_cast<uint32_t>(mode),
+                               static_cast<uint32_t>(tv.size())};
+    AppendPod(buf, header);
+
+    for (auto tok : tv) {
+      TokenRecord rec = {0, 0, tok.line(), tok.col(), static_cast<uint32_t>(tok.type())};
+      if (!ToOffset(src, tok.range(), rec.offset, rec.size))
+        return;
+      AppendPod(buf, rec);
+    }
+
+    auto& kelems = *tv[0].kelems();
+
+    AppendPod(buf, static_cast<uint32_t>(kelems.includes.size()));
+    for (auto& incl : kelems.includes) {
+      uint32_t offset, size = 0;
+      if (incl.first.Start() == first_include_key)
+        offset = kFirstIncludeKey;
+      else if (incl.first.Start() == last_include_key)
+        offset = kLastIncludeKey;
+      else if (!ToOffset(src, incl.first, offset, size))
+        return;
+      AppendPod(buf, offset);
+      AppendPod(buf, size);
+      AppendPod(buf, static_cast<uint64_t>(incl.second));
+    }
+
+    AppendPod(buf, static_cast<uint32_t>(kelems.scopes.size()));
+    for (auto& sb : kelems.scopes) {
+      uint32_t offset, size;
+      if (!ToOffset(src, sb.name, offset, size))
+        return;
+      AppendPod(buf, static_cast<uint32_t>(sb.type));
+      AppendPod(buf, offset);
+      AppendPod(buf, size);
+      AppendPod(buf, static_cast<uint64_t>(sb.top));
+      AppendPod(buf, static_cast<uint64_t>(sb.start));
+      AppendPod(buf, static_cast<uint64_t>(sb.end));
+    }
+
+    AppendPod(buf, static_cast<uint32_t>(kelems.properties.size()));
+    for (auto& prop : kelems.properties) {
+      AppendStr(buf, prop.first);
+      AppendPod(buf, static_cast<uint32_t>(prop.second.size()));
+      for (auto& value : prop.second)
+        AppendStr(buf, value);
+    }
+
+    AppendPod(buf, static_cast<uint32_t>(kelems.plex_comments.size()));
+    for (auto& comment : kelems.plex_comments)
+      AppendStr(buf, comment);
+
+    // Write to a private file and then rename it so concurrent plex processes
+    // never see a partial entry.
+    static std::atomic<int> tmp_count(0);
+    auto tmp_path = dir_.Append(HexName(hash) +
+        L"." + std::to_wstring(::GetCurrentProcessId()) +
+        L"." + std::to_wstring(tmp_count++) + L".tmp");
+    bool written;
+    {
+      File file = File::Create(tmp_path,
+                               FileParams::ReadWriteSharedRead(CREATE_ALWAYS),
+                               FileSecurity());
+      if (!file.IsValid())
+        return;
+      written = (file.Write(FromString(buf)) == buf.size());
+    }
+    if (!written ||
+        !::MoveFileExW(tmp_path.Raw(), EntryPath(hash).Raw(), MOVEFILE_REPLACE_EXISTING))
+      ::DeleteFileW(tmp_path.Raw());
+  }
+
+private:
+  FilePath EntryPath(uint64_t hash) const {
+    return dir_.Append(HexName(hash) + L".ptc");
+  }
+
+  static std::wstring HexName(uint64_t hash) {
+    wchar_t buf[17];
+    swprintf(buf, _countof(buf), L"%016llx", static_cast<unsigned long long>(hash));
+    return buf;
+  }
+
+  static bool ToOffset(const Range<char>& src, const Range<char>& r,
+                       uint32_t& offset, uint32_t& size) {
+    if (!r.Start()) {
+      offset = kNullOffset;
+      size = 0;
+      return true;
+    }
+    if ((r.Start() < src.Start()) || (r.End() > src.End()))
+      return false;
+    offset = static_cast<uint32_t>(r.Start() - src.Start());
+    size = static_cast<uint32_t>(r.Size());
+    return true;
+  }
+
+  static bool ToRange(const Range<char>& src, uint32_t offset, uint32_t size,
+                      Range<char>& r) {
+    if (offset == kNullOffset) {
+      r = Range<char>();
+      return true;
+    }
+    if ((offset > src.Size()) || (size > (src.Size() - offset)))
+      return false;
+    r = Range<char>(src.Start() + offset, src.Start() + offset + size);
+    return true;
+  }
+
+  template <typename T>
+  static void AppendPod(std::string& buf, const T& v) {
+    buf.append(reinterpret_cast<const char*>(&v), sizeof(v));
+  }
+
+  static void AppendStr(std::string& buf, const std::string& str) {
+    AppendPod(buf, static_cast<uint32_t>(str.size()));
+    buf.append(str);
+  }
+};
+
+// Tokenizes and lexes |path|, going through |cache| when there is one.
+CppTokenVector LoadLexedTokens(const FilePath& path, LexMode mode, TokenCache* cache) {
+  ++plex_counters.catalog_files;
+  if (!cache) {
+    return TokenizeAndLexCpp(path, mode);
+  }
+
+  auto src = LoadFileOnce(path);
+  CppTokenVector tv;
+  if (cache->Load(path, src, mode, tv)) {
+    ++plex_counters.cache_hits;
+    return tv;
+  }
+
+  tv = TokenizeAndLexCpp(path, mode, &src);
+  cache->Store(src, mode, tv);
+  return tv;
+}
+
+#pragma endregion
+
 #pragma region xdef
 struct XEntity;
 
@@ -1826,7 +4094,164 @@ struct XEntity {
   }
 };
 
-typedef std::unordered_map<std::string, XternDef> XternDefs;
+// The catalog index compiled by --compile-index into index.plexidx, next to
+// index.plex. The file is used mapped as it is, so loading it does not depend on
+// the catalog size. Layout: CompiledIndexHeader, bucket_count bucket slots that
+// hold an entry number plus one (0 is empty), entry_count CompiledEntry and then
+// the pool of names, paths and library extras the entries point into. A name is
+// found by linear probing from the low bits of its hash.
+class CompiledIndex {
+public:
+  static const uint32_t kFormat = 1;
+
+  struct CompiledIndexHeader {
+    char magic[4];
+    uint32_t format;
+    uint32_t bucket_count;
+    uint32_t entry_count;
+    uint32_t pool_size;
+  };
+
+  struct CompiledEntry {
+    uint32_t hash;
+    uint32_t type;
+    uint32_t name;
+    uint32_t name_size;
+    uint32_t path;
+    uint32_t path_size;
+    uint32_t extra;
+    uint32_t extra_size;
+  };
+
+  CompiledIndex() : header_(nullptr), buckets_(nullptr), entries_(nullptr), pool_(nullptr) {}
+
+  static FilePath PathFor(const FilePath& index) {
+    return index.Parent().Append(index.Leaf() + L"idx");
+  }
+
+  static uint32_t Hash(const Range<char>& name) {
+    return static_cast<uint32_t>(HashFNV1a(name));
+  }
+
+  // Maps the compiled form of |index| if it exists, is newer than |index| and
+  // is of this format. Returns false otherwise.
+  bool Open(const FilePath& index) {
+    auto path = PathFor(index);
+    uint64_t compiled_time, index_time;
+    {
+      File compiled = File::Create(path, FileParams::ReadSharedRead(), FileSecurity());
+      if (!compiled.IsValid())
+        return false;
+      File source = File::Create(index, FileParams::ReadSharedRead(), FileSecurity());
+      if (!source.IsValid())
+        return false;
+      compiled_time = compiled.LastWriteTime();
+      index_time = source.LastWriteTime();
+    }
+    if (compiled_time <= index_time)
+      return false;
+
+    auto file = LoadFileOnce(path);
+    if (file.Size() < sizeof(CompiledIndexHeader))
+      return false;
+    auto header = reinterpret_cast<const CompiledIndexHeader*>(file.Start());
+    if ((memcmp(header->magic, "PXCI", 4) != 0) || (header->format != kFormat))
+      return false;
+    auto count = header->bucket_count;
+    if (!count || (count & (count - 1)) || (header->entry_count >= count))
+      return false;
+    const uint64_t size = sizeof(CompiledIndexHeader) +
+                          uint64_t(count) * sizeof(uint32_t) +
+                          uint64_t(header->entry_count) * sizeof(CompiledEntry) +
+                          header->pool_size;
+    if (size != file.Size())
+      return false;
+
+    header_ = header;
+    buckets_ = reinterpret_cast<const uint32_t*>(header + 1);
+    entries_ = reinterpret_cast<const CompiledEntry*>(buckets_ + count);
+    pool_ = reinterpret_cast<char*>(const_cast<CompiledEntry*>(entries_ + header->entry_count));
+    return true;
+  }
+
+  // Fills |def| with the definition named |name|. Returns false if there is none.
+  bool Find(const Range<char>& name, XternDef& def) const {
+    if (!header_)
+      return false;
+    const uint32_t hash = Hash(name);
+    const uint32_t mask = header_->bucket_count - 1;
+    for (uint32_t ix = hash & mask; buckets_[ix]; ix = (ix + 1) & mask) {
+      if (buckets_[ix] > header_->entry_count)
+        return false;
+      auto& entry = entries_[buckets_[ix] - 1];
+      if (entry.hash != hash)
+        continue;
+      Range<char> entry_name;
+      if (!PoolRange(entry.name, entry.name_size, entry_name) || !entry_name.Equal(name))
+        continue;
+      def = XternDef();
+      def.type = static_cast<XternDef::Type>(entry.type);
+      def.name = entry_name;
+      return PoolRange(entry.path, entry.path_size, def.path) &&
+             PoolRange(entry.extra, entry.extra_size, def.extra);
+    }
+    return false;
+  }
+
+private:
+  const CompiledIndexHeader* header_;
+  const uint32_t* buckets_;
+  const CompiledEntry* entries_;
+  char* pool_;
+
+  bool PoolRange(uint32_t offset, uint32_t size, Range<char>& range) const {
+    if ((uint64_t(offset) + size) > header_->pool_size)
+      return false;
+    range = Range<char>(pool_ + offset, pool_ + offset + size);
+    return true;
+  }
+
+  CompiledIndex(const CompiledIndex&);
+  CompiledIndex& operator=(const CompiledIndex&);
+};
+
+// The catalog definitions by name. When they come from a compiled index they are
+// brought in from it by the first lookup of each name, so only the names that
+// are used ever get here.
+class XternDefs {
+  typedef std::unordered_map<Atom, XternDef> DefMap;
+  DefMap defs_;
+  const CompiledIndex* compiled_;
+
+public:
+  typedef DefMap::iterator iterator;
+
+  explicit XternDefs(const CompiledIndex* compiled = nullptr) : compiled_(compiled) {}
+
+  iterator begin() { return defs_.begin(); }
+  iterator end() { return defs_.end(); }
+  bool empty() const { return defs_.empty(); }
+  bool IsCompiled() const { return compiled_ != nullptr; }
+
+  XternDef& operator[](Atom atom) {
+    return defs_[atom];
+  }
+
+  // Returns the definition named |name| or nullptr. Parsed catalog names are all
+  // interned, so a name without an atom can't be one of them.
+  XternDef* Find(const Range<char>& name) {
+    auto atom = Atoms::Get().Find(name);
+    if (atom != Atoms::kNone) {
+      auto it = defs_.find(atom);
+      if (it != defs_.end())
+        return &it->second;
+    }
+    XternDef def;
+    if (!compiled_ || !compiled_->Find(name, def))
+      return nullptr;
+    return &(defs_[Atoms::Get().Intern(def.name)] = def);
+  }
+};
 
 int GetExternalDefinitions(CppTokenVector& tv,
                            XternDefs& xdefs,
@@ -1863,24 +4288,24 @@ int GetExternalDefinitions(CppTokenVector& tv,
       t == CppToken::kw_volatile);
   };
 
-  auto IsInVector = [](const CppTokenVector& v,
+  // Only the names of the tokens below are looked at, so only they are kept.
+  typedef std::vector<Range<char>> NameVector;
+
+  auto IsInVector = [](const NameVector& v,
                        const Range<const char>& r) -> bool {
     for (auto it = begin(v); it != end(v); ++it) {
-      if (EqualToStr(*it, r))
+      if (it->Equal(r))
         return true;
     }
     return false;
   };
 
-  auto path = tv[0].kelems->src_path;
-  auto& scopes = tv[0].kelems->scopes;
+  auto path = tv[0].kelems()->src_path;
+  auto kelems = tv[0].kelems();
 
-  auto GetEndScope = [&scopes](size_t start) -> size_t {
-    for (auto& s : scopes) {
-      if (s.start == start)
-        return s.end;
-    }
-    return 0;
+  auto GetEndScope = [kelems](size_t start) -> size_t {
+    auto s = kelems->ScopeAt(start);
+    return s ? s->end : 0;
   };
 
   // Here we assume that the code file consists of a series
@@ -1889,15 +4314,15 @@ int GetExternalDefinitions(CppTokenVector& tv,
   // expression statements.
 
   // Local definitions.
-  CppTokenVector ldefs;
+  NameVector ldefs;
   // Local references, they don't have a visible definition.
-  CppTokenVector xrefs;
+  NameVector xrefs;
   // Local variables, they reset at each scope. Note that other
   // things can end up here, for example function definitions.
-  std::vector<CppTokenVector> lvars;
+  std::vector<NameVector> lvars;
 
   // adding the global scope.
-  lvars.push_back(CppTokenVector());
+  lvars.push_back(NameVector());
 
   std::vector<const char*> enclosing_definition;
   bool in_local_definition = false;
@@ -1907,17 +4332,17 @@ int GetExternalDefinitions(CppTokenVector& tv,
   // Skip over SOS token.
   auto last = ++begin(tv);
 
-  for(auto it = last; it->type != CppToken::eos; ++it) {
-    auto& prev = *(it - 1);
-    auto& next = *(it + 1);
+  for(auto it = last; it->type() != CppToken::eos; ++it) {
+    auto prev = *(it - 1);
+    auto next = *(it + 1);
 
-    if (it->type == CppToken::comment)
+    if (it->type() == CppToken::comment)
       continue;
 
-    if (it->type == CppToken::open_cur_bracket) {
-      lvars.push_back(CppTokenVector());
+    if (it->type() == CppToken::open_cur_bracket) {
+      lvars.push_back(NameVector());
 
-      if (prev.type != CppToken::kw_namespace) {
+      if (prev.type() != CppToken::kw_namespace) {
         if (in_local_definition)
           in_local_definition = false;
         else 
@@ -1925,7 +4350,7 @@ int GetExternalDefinitions(CppTokenVector& tv,
       }
       continue;
 
-    } else if (it->type == CppToken::close_cur_bracket) {
+    } else if (it->type() == CppToken::close_cur_bracket) {
       lvars.pop_back();
 
       if (!enclosing_definition.empty()) {
@@ -1933,19 +4358,19 @@ int GetExternalDefinitions(CppTokenVector& tv,
       }
       continue;
       
-    } else if (it->type == CppToken::kw_if_exists) {
+    } else if (it->type() == CppToken::kw_if_exists) {
       // Skip everything inside a __if_exists block.
       size_t d = end(tv) - it;
       if (d < 7)
-        throw TokenizerException(path.Raw(), __LINE__, it->line);
+        throw TokenizerException(path.Raw(), __LINE__, it->line());
       auto it2 = it + 1;
-      if (it2->type == CppToken::open_paren) {
+      if (it2->type() == CppToken::open_paren) {
         ++it2;
-        if (it2->type == CppToken::identifier) {
+        if (it2->type() == CppToken::identifier) {
           ++it2;
-          if (it2->type == CppToken::close_paren) {
+          if (it2->type() == CppToken::close_paren) {
             ++it2;
-            if (it2->type == CppToken::open_cur_bracket) {
+            if (it2->type() == CppToken::open_cur_bracket) {
               size_t pos = it2 - begin(tv);
               size_t close = GetEndScope(pos);
               if (close > pos) {
@@ -1956,69 +4381,70 @@ int GetExternalDefinitions(CppTokenVector& tv,
           }
         } 
       }
-      throw TokenizerException(path.Raw(), __LINE__, it->line);
+      throw TokenizerException(path.Raw(), __LINE__, it->line());
       
-    } else if (it->type == CppToken::identifier) {
-      if (prev.type == CppToken::kw_namespace) {
-        if (next.type != CppToken::open_cur_bracket)
+    } else if (it->type() == CppToken::identifier) {
+      if (prev.type() == CppToken::kw_namespace) {
+        if (next.type() != CppToken::open_cur_bracket)
           __debugbreak();
-        lvars.push_back(CppTokenVector());
+        lvars.push_back(NameVector());
         ++it;
         continue;
 
-      } else if (IsAgregateIntroducer(prev.type)) {
-        if (next.type == CppToken::semicolon) {
-          if (IsInVector(ldefs, it->range)) {
+      } else if (IsAgregateIntroducer(prev.type())) {
+        if (next.type() == CppToken::semicolon) {
+          if (IsInVector(ldefs, it->range())) {
             // defined twice? explode. Unless its a friend declaration.
-            if ((it - 2)->type != CppToken::kw_friend)
-              throw TokenizerException(path.Raw(), __LINE__, it->line);
+            if ((it - 2)->type() != CppToken::kw_friend)
+              throw TokenizerException(path.Raw(), __LINE__, it->line());
           } else {
             // forward declaration.
-            ldefs.push_back(*it);
+            ldefs.push_back(it->range());
             continue;
           }
         }
         // local definition.
-        enclosing_definition.push_back(it->range.Start());
-        ldefs.push_back(*it);
+        enclosing_definition.push_back(it->range().Start());
+        ldefs.push_back(it->range());
         in_local_definition = true;
         continue;
       }
 
-      if (!IsInVector(ldefs, it->range)) {
+      if (!IsInVector(ldefs, it->range())) {
 
-        if(IsInVector(xrefs, it->range)) {
+        if(IsInVector(xrefs, it->range())) {
           continue;
         }
 
-        if (prev.type == CppToken::period)
+        if (prev.type() == CppToken::period)
           continue;
 
         // could be variable declaration. Scan backwards.
         bool is_var_decl = false;
         auto rit = it;
         while(--rit != begin(tv)) {
-          if (IsBuiltIn(rit->type)) {
+          if (IsBuiltIn(rit->type())) {
             is_var_decl = true;
             break;
           }
-          if (rit->type == CppToken::identifier) {
+          if (rit->type() == CppToken::identifier) {
             is_var_decl = true;
             break;
           }
-          if (!IsModifier(rit->type))
+          if (!IsModifier(rit->type()))
             break;
         }
 
         if (is_var_decl) {
-          lvars.back().push_back(*it);
+          lvars.back().push_back(it->range());
           continue;
         } else {
           // check in our stack of local vars.
           bool is_var_use = false;
+          auto name = it->range();
           for (auto ix = begin(lvars); ix != end(lvars); ++ix) {
             for (auto iy = begin(*ix); iy != end(*ix); ++iy) {
-              if (it->range.Equal(iy->range)) {
+              if (name.Equal(*iy)) {
                 is_var_use = true;
                 break;
               }  
@@ -2029,26 +4455,26 @@ int GetExternalDefinitions(CppTokenVector& tv,
         }
 
         // possible external reference, need to check in db.
-        auto xdit = xdefs.find(ToString(*it));
-        if ( xdit!= xdefs.end()) {
+        auto xdef = xdefs.Find(it->range());
+        if (xdef) {
           // reference found.
-          auto& found_xdef = xdit->second;
+          auto& found_xdef = *xdef;
           if (!found_xdef.entity) {
             ++new_xdefs;
-            found_xdef.entity = new XEntity(found_xdef, nullptr);
-            Logger::Get().AddExternDef(found_xdef.name, it->line);
+            found_xdef.entity = RunArena().New<XEntity>(found_xdef, nullptr);
+            Logger::Get().AddExternDef(found_xdef.name, it->line());
           }
           if (entity) {
             if (found_xdef.type != XternDef::include) {
               if (found_xdef.entity == entity) {
                 // self reference, probably full name in the same file. Could ignore
                 // it but best to have the user to fix the reference.
-                throw TokenizerException(path.Raw(), __LINE__, it->line);
+                throw TokenizerException(path.Raw(), __LINE__, it->line());
               }
               entity->deps.push_back(found_xdef.entity);
             }
           }
-          xrefs.push_back(*it);
+          xrefs.push_back(it->range());
           continue;
         }
 
@@ -2080,8 +4506,8 @@ void ProcessCatalog(CppTokenVector& tv, XternDefs& defs) {
 
   for (;;) {
     // find block.
-    for( ; it->type != CppToken::open_cur_bracket; ++it) {
-      if (it->type == CppToken::eos) {
+    for( ; it->type() != CppToken::open_cur_bracket; ++it) {
+      if (it->type() == CppToken::eos) {
         if (defs.empty())
           throw CatalogException(__LINE__, 0);
         else
@@ -2094,31 +4520,90 @@ void ProcessCatalog(CppTokenVector& tv, XternDefs& defs) {
     } else if (EqualToStr(*(it - 2), "catalog")) {
       kind = XternDef::item;
     } else {
-      throw CatalogException(__LINE__, it->line);
+      throw CatalogException(__LINE__, it->line());
     }
     
     ++it;
     // process block.    
-    for( ; it->type != CppToken::close_cur_bracket; ++it) {
-      if (it->type != CppToken::identifier)
-        throw CatalogException(__LINE__, it->line);
+    for( ; it->type() != CppToken::close_cur_bracket; ++it) {
+      if (it->type() != CppToken::identifier)
+        throw CatalogException(__LINE__, it->line());
       auto key = it;
       ++it;
       auto val = it;
-      for (; it->type != CppToken::semicolon; ++it) {
-        if (it->type ==  CppToken::eos)
-          throw CatalogException(__LINE__, it->line);
+      for (; it->type() != CppToken::semicolon; ++it) {
+        if (it->type() ==  CppToken::eos)
+          throw CatalogException(__LINE__, it->line());
       }
-      // insert one entry.
+      // insert one entry. The rest of the value tokens are left behind, erasing
+      // them made loading quadratic in the catalog size.
       CoaleseToken(val, it - 1, CppToken::const_str);
-      it = tv.erase(val + 1, it);
-      defs[ToString(*key)] = XternDef(kind, key->range, val->range);
+      defs[AtomOf(*key)] = XternDef(kind, key->range(), val->range());
     }
     ++it;
   }
 
 }
 
+// Writes the compiled form of the catalog |defs| to |path|, see CompiledIndex.
+// The entries are in name order so a catalog always compiles to the same bytes.
+size_t WriteCompiledIndex(const FilePath& path, XternDefs& defs) {
+  std::vector<const XternDef*> sorted;
+  for (auto it = defs.begin(); it != defs.end(); ++it)
+    sorted.push_back(&it->second);
+  std::sort(begin(sorted), end(sorted), [] (const XternDef* d1, const XternDef* d2) {
+    return ToString(d1->name) < ToString(d2->name);
+  });
+
+  // At most half full, which keeps the probe sequences short.
+  uint32_t bucket_count = 16;
+  while (bucket_count < 2 * sorted.size())
+    bucket_count *= 2;
+  std::vector<uint32_t> buckets(bucket_count, 0);
+  std::vector<CompiledIndex::CompiledEntry> entries;
+  std::string pool;
+
+  auto AddToPool = [&pool](const Range<char>& r, uint32_t& offset, uint32_t& size) {
+    offset = static_cast<uint32_t>(pool.size());
+    size = static_cast<uint32_t>(r.Size());
+    pool.append(r.Start(), r.Size());
+  };
+
+  for (auto def : sorted) {
+    CompiledIndex::CompiledEntry entry = {};
+    entry.hash = CompiledIndex::Hash(def->name);
+    entry.type = def->type;
+    AddToPool(def->name, entry.name, entry.name_size);
+    AddToPool(def->path, entry.path, entry.path_size);
+    AddToPool(def->extra, entry.extra, entry.extra_size);
+    entries.push_back(entry);
+
+    auto ix = entry.hash & (bucket_count - 1);
+    while (buckets[ix])
+      ix = (ix + 1) & (bucket_count - 1);
+    buckets[ix] = static_cast<uint32_t>(entries.size());
+  }
+
+  CompiledIndex::CompiledIndexHeader header = {
+      {'P', 'X', 'C', 'I'}, CompiledIndex::kFormat, bucket_count,
+      static_cast<uint32_t>(entries.size()), static_cast<uint32_t>(pool.size())};
+  std::string buf(reinterpret_cast<const char*>(&header), sizeof(header));
+  buf.append(reinterpret_cast<const char*>(buckets.data()), buckets.size() * sizeof(uint32_t));
+  buf.append(reinterpret_cast<const char*>(entries.data()),
+             entries.size() * sizeof(CompiledIndex::CompiledEntry));
+  buf.append(pool);
+
+  // Always written, even if unchanged, so it is newer than the index.
+  File file = File::Create(path,
+                           FileParams::ReadWriteSharedRead(CREATE_ALWAYS),
+                           FileSecurity());
+  if (!file.IsValid())
+    throw IOException(__LINE__, path.Raw());
+  if (file.Write(FromString(buf)) != buf.size())
+    throw IOException(__LINE__, path.Raw(), "write");
+  return entries.size();
+}
+
 #pragma endregion
 
 struct XInclude {
@@ -2137,35 +4622,146 @@ struct XInclude {
   bool Order(const XInclude& other) const {
     return ToString(name) < ToString(other.name);
   }
-};
-
-struct XEntities {
-  std::deque<XInclude> includes;
-  std::deque<XEntity*> code;
+};
+
+struct XEntities {
+  std::deque<XInclude> includes;
+  std::deque<XEntity*> code;
+
+  void Add_Front(const XEntities& other) {
+    includes.insert(begin(includes), begin(other.includes), end(other.includes));
+    code.insert(begin(code), begin(other.code), end(other.code));
+  }
+
+  void Dedup_Includes() {
+    // The way that LoadEntities recurses means that Add_Front() introduces
+    // several copies of each include. Take care of that here.
+    std::sort(begin(includes), end(includes), 
+      [] (const XInclude& e1, const XInclude& e2) {
+        return e1.Order(e2);
+      });
+    auto last = std::unique(begin(includes), end(includes),
+      [] (const XInclude& e1, const XInclude& e2) {
+        return e1.name.Equal(e2.name);
+      });
+    includes.erase(last, end(includes));
+  }
+};
+
+bool ReadWholeFile(const FilePath& path, std::string& contents);
+
+// The catalog of a batch run or of the server. The index is parsed once and each
+// catalog file is tokenized and lexed once, by the first unit that needs it.
+// Units get copies of the token vectors because ProcessEntities() edits them in
+// place. The key elements are owned here so the catalog outlives the run arena.
+class SharedCatalog {
+  struct Entry {
+    std::once_flag once;
+    CppTokenVector tv;
+    std::unique_ptr<KeyElements> kelems;
+  };
+
+  struct Source {
+    std::wstring path;
+    long long id;
+    uint64_t write_time;
+    size_t hash;
+  };
+
+  TokenCache* cache_;
+  CppTokenVector index_tv_;
+  std::unique_ptr<KeyElements> index_kelems_;
+  CompiledIndex compiled_;
+  XternDefs xdefs_;
+  std::unordered_map<std::wstring, std::unique_ptr<Entry>> entries_;
+  std::vector<Source> sources_;
+  std::mutex lock_;
+
+public:
+  SharedCatalog(const FilePath& index, TokenCache* cache)
+      : cache_(cache) {
+    if (compiled_.Open(index)) {
+      xdefs_ = XternDefs(&compiled_);
+      Track(index);
+      Track(CompiledIndex::PathFor(index));
+    } else {
+      index_tv_ = LoadLexedTokens(index, LexMode::PlexCPP, cache);
+      Adopt(index, index_tv_, index_kelems_);
+      ProcessCatalog(index_tv_, xdefs_);
+    }
+  }
+
+  // The catalog definitions, none of them resolved.
+  const XternDefs& Definitions() const {
+    return xdefs_;
+  }
+
+  CppTokenVector Tokens(const FilePath& path) {
+    Entry* entry;
+    {
+      std::lock_guard<std::mutex> lock(lock_);
+      auto& slot = entries_[path.Raw()];
+      if (!slot)
+        slot.reset(new Entry);
+      entry = slot.get();
+    }
+    std::call_once(entry->once, [this, entry, &path]() {
+      entry->tv = LoadLexedTokens(path, LexMode::PlexCPP, cache_);
+      Adopt(path, entry->tv, entry->kelems);
+    });
+    return entry->tv;
+  }
+
+  // True if |id| is the unique id of a file of the catalog.
+  bool Uses(long long id) {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (auto& src : sources_) {
+      if (src.id == id)
+        return true;
+    }
+    return false;
+  }
+
+  // Checks that no catalog file changed since it was loaded. Files with a new
+  // write time are hashed again so a touch alone does not invalidate.
+  bool IsCurrent() {
+    std::lock_guard<std::mutex> lock(lock_);
+    for (auto& src : sources_) {
+      File file = File::Create(FilePath(src.path), FileParams::ReadSharedRead(), FileSecurity());
+      if (!file.IsValid())
+        return false;
+      auto write_time = file.LastWriteTime();
+      if (write_time == src.write_time)
+        continue;
+      std::string text;
+      if (!ReadWholeFile(FilePath(src.path), text) || (HashFNV1a(FromString(text)) != src.hash))
+        return false;
+      src.write_time = write_time;
+    }
+    return true;
+  }
 
-  void Add_Front(const XEntities& other) {
-    includes.insert(begin(includes), begin(other.includes), end(other.includes));
-    code.insert(begin(code), begin(other.code), end(other.code));
+private:
+  void Adopt(const FilePath& path, CppTokenVector& tv, std::unique_ptr<KeyElements>& kelems) {
+    kelems.reset(new KeyElements(*tv[0].kelems()));
+    tv[0].set_kelems(kelems.get());
+    Track(path);
   }
 
-  void Dedup_Includes() {
-    // The way that LoadEntities recurses means that Add_Front() introduces
-    // several copies of each include. Take care of that here.
-    std::sort(begin(includes), end(includes), 
-      [] (const XInclude& e1, const XInclude& e2) {
-        return e1.Order(e2);
-      });
-    auto last = std::unique(begin(includes), end(includes),
-      [] (const XInclude& e1, const XInclude& e2) {
-        return e1.name.Equal(e2.name);
-      });
-    includes.erase(last, end(includes));
+  void Track(const FilePath& path) {
+    File file = File::Create(path, FileParams::ReadSharedRead(), FileSecurity());
+    if (!file.IsValid())
+      throw IOException(__LINE__, path.Raw());
+    Source src = { path.Raw(), file.GetUniqueId(), file.LastWriteTime(), HashFNV1a(LoadFileOnce(path)) };
+    std::lock_guard<std::mutex> lock(lock_);
+    sources_.push_back(src);
   }
 };
 
-XEntities LoadEntities(XternDefs& xdefs, const FilePath& path) {
+XEntities LoadEntities(XternDefs& xdefs, const FilePath& path, TokenCache* cache,
+                       SharedCatalog* shared = nullptr) {
   XEntities ents;
-  for (auto it = begin(xdefs); it != end(xdefs); ++it) {
+  for (auto it = xdefs.begin(); it != xdefs.end(); ++it) {
     auto& def = it->second;
     if (!def.entity)
       continue;
@@ -2175,14 +4771,15 @@ XEntities LoadEntities(XternDefs& xdefs, const FilePath& path) {
     if (it->second.type == XternDef::include) {
       ents.includes.push_back(XInclude(def));
     } else {
-      auto tok = new CppTokenVector(TokenizeCpp(path.Append(AsciiToUTF16(def.path))));
-      LexCppTokens(LexMode::PlexCPP, *tok);
+      auto file = path.Append(AsciiToUTF16(def.path));
+      auto tok = RunArena().New<CppTokenVector>(shared ?
+          shared->Tokens(file) : LoadLexedTokens(file, LexMode::PlexCPP, cache));
       def.entity->tv = tok;
       ents.code.push_back(def.entity);
       // Get external definitions and create/insert the new xentity.
       if (GetExternalDefinitions(*tok, xdefs, def.entity)) {
         // Recurse now.
-        auto inner = LoadEntities(xdefs, path);
+        auto inner = LoadEntities(xdefs, path, cache, shared);
         ents.Add_Front(inner);
       }
     }
@@ -2191,79 +4788,186 @@ XEntities LoadEntities(XternDefs& xdefs, const FilePath& path) {
   return ents;
 }
 
-void InsertAtToken(CppToken& src, Insert::Kind kind, CppTokenVector& tv) {
-  if (!src.insert)
-    src.insert = new Insert(kind);
+// Same result as LoadEntities() but the catalog is walked one layer at the time:
+// the new definitions of a layer are tokenized and lexed on |jobs| threads and
+// then their external definitions are resolved serially in name order, which
+// yields the next layer.
+XEntities LoadEntitiesParallel(XternDefs& xdefs, const FilePath& path,
+                               TokenCache* cache, int jobs) {
+  XEntities ents;
+  // Function statics used by the tokenizer and the lexer are initialized
+  // before any thread runs.
+  GetCharClassTable();
+  GetIdentifierWordTable();
+  GetPreprocessorWordTable();
+  RunArena();
+  Atoms::Get();
+
+  for (;;) {
+    std::vector<XternDef*> layer;
+    for (auto it = xdefs.begin(); it != xdefs.end(); ++it) {
+      auto& def = it->second;
+      if (!def.entity || def.entity->tv)
+        continue;
+      if (def.type != XternDef::include)
+        layer.push_back(&def);
+    }
+    if (layer.empty())
+      break;
+
+    std::sort(begin(layer), end(layer), [] (const XternDef* d1, const XternDef* d2) {
+      return ToString(d1->name) < ToString(d2->name);
+    });
+
+    std::vector<CppTokenVector*> tvs(layer.size());
+    ParallelFor(layer.size(), jobs, [&] (size_t ix) {
+      tvs[ix] = RunArena().New<CppTokenVector>(
+          LoadLexedTokens(path.Append(AsciiToUTF16(layer[ix]->path)), LexMode::PlexCPP, cache));
+    });
+
+    for (size_t ix = 0; ix != layer.size(); ++ix) {
+      auto& def = *layer[ix];
+      def.entity->tv = tvs[ix];
+      ents.code.push_back(def.entity);
+      GetExternalDefinitions(*tvs[ix], xdefs, def.entity);
+    }
+  }
+
+  for (auto it = xdefs.begin(); it != xdefs.end(); ++it) {
+    auto& def = it->second;
+    if (def.entity && (def.type == XternDef::include))
+      ents.includes.push_back(XInclude(def));
+  }
+
+  return ents;
+}
+
+void InsertAtToken(CppTokenRef src, Insert::Kind kind, CppTokenVector& tv) {
+  if (!src.insert())
+    src.set_insert(RunArena().New<Insert>(kind));
   // Minimal insertion has two tokens: SOS + tv[0].
-  auto start = tv[0].range.Start();
+  auto start = tv[0].range().Start();
   CppToken control(Range<char>(start, start), CppToken::plex_insert, 0, 0);
 
-  auto& exv = src.insert->tv;
-  const int b_line = exv.empty() ? src.line : exv[exv.size()-1].line + 1;
+  auto& exv = src.insert()->tv;
+  const int b_line = exv.empty() ? src.line() : exv.back().line() + 1;
 
-  if (tv[0].type == CppToken::sos) {
+  if (tv[0].type() == CppToken::sos) {
     // replace SOS for the insert token.
     tv[0] = control;
   } else {
     control.line += b_line;
-    src.insert->tv.push_back(control);
+    exv.push_back(control);
   }
 
-  // Insert most tokens and renumber the lines as we go along.
-  const int start_line = tv[0].line;
+  // Insert most tokens, renumbered to follow the previous insert.
+  tv.ShiftLines(b_line - tv[0].line());
 
-  for (auto& tok : tv) {
-    auto t = tok.type;
+  for (auto tok : tv) {
+    auto t = tok.type();
     if (t == CppToken::eos || t == CppToken::plex_comment)
       continue;
-    tok.line = b_line + (tok.line - start_line);
-    src.insert->tv.push_back(tok);
+    exv.push_back(tok);
   }
 }
 
-void ProcessEntities(CppTokenVector& in_src, XEntities& ent) {
-  std::sort(begin(ent.includes), end(ent.includes), 
-      [] (const XInclude& e1, const XInclude& e2) {
-        return e1.Order(e2);
+// Returns the names of a dependency cycle among the entities of |code| that
+// still have |pending| dependencies, in the form "a -> b -> a" where a depends
+// on b.
+std::string FindDependencyCycle(const std::deque<XEntity*>& code,
+                                const std::vector<std::vector<size_t>>& deps,
+                                const std::vector<size_t>& pending) {
+  size_t curr = 0;
+  while (!pending[curr])
+    ++curr;
+
+  std::vector<size_t> path;
+  std::unordered_map<size_t, size_t> path_pos;
+  while (path_pos.find(curr) == end(path_pos)) {
+    path_pos[curr] = path.size();
+    path.push_back(curr);
+    for (auto d : deps[curr]) {
+      if (pending[d]) {
+        curr = d;
+        break;
       }
-  );
+    }
+  }
+
+  std::string cycle;
+  for (size_t ix = path_pos[curr]; ix != path.size(); ++ix)
+    cycle += ToString(code[path[ix]]->name) + " -> ";
+  return cycle + ToString(code[curr]->name);
+}
 
-  std::sort(begin(ent.code), end(ent.code), 
+// Orders |code| so each entity comes after all its dependencies, using Kahn's
+// algorithm. When several entities are ready the first one in XEntity::Order()
+// goes first, so the result only depends on the names and the dependencies.
+void OrderCodeEntities(std::deque<XEntity*>& code) {
+  std::sort(begin(code), end(code), 
       [] (const XEntity* e1, const XEntity* e2) {
         return e1->Order(*e2);
       }
   );
 
-  // Lazy attempt to re-order the code if the dependency order
-  // is wrong. Easy to detect but hard to fix completely. We try
-  // several times exchanging the order.
-  if (ent.code.size() > 1) {
-    int tries = 30;
-    bool go_again = true;
-    while ((--tries != 0) && go_again) {
-      go_again = false;
-      for (auto ix = begin(ent.code); ix != end(ent.code); ++ix) {
-        for (auto& d : (*ix)->deps) {
-          auto xd = std::find(ix + 1, end(ent.code), d);
-          if (xd != end(ent.code)) {
-            // Sort order is wrong, a dependency is below.
-            std::swap(*ix, *xd);
-            go_again = true;
-            goto leave;
-          }
-        }
-      }
-      leave: ;
-    }  // while.
+  // From here on entities are identified by their position in sorted order.
+  const size_t count = code.size();
+  std::unordered_map<XEntity*, size_t> rank;
+  for (size_t ix = 0; ix != count; ++ix)
+    rank[code[ix]] = ix;
+
+  std::vector<std::vector<size_t>> deps(count);
+  std::vector<std::vector<size_t>> dependents(count);
+  std::vector<size_t> pending(count);
+
+  for (size_t ix = 0; ix != count; ++ix) {
+    auto& dv = deps[ix];
+    for (auto d : code[ix]->deps) {
+      auto r = rank.find(d);
+      if (r != end(rank))
+        dv.push_back(r->second);
+    }
+    std::sort(begin(dv), end(dv));
+    dv.erase(std::unique(begin(dv), end(dv)), end(dv));
+    pending[ix] = dv.size();
+    for (auto d : dv)
+      dependents[d].push_back(ix);
+  }
+
+  std::set<size_t> ready;
+  for (size_t ix = 0; ix != count; ++ix) {
+    if (!pending[ix])
+      ready.insert(ix);
+  }
 
-    if (go_again) {
-      // we could not find an arrangement of code inserts that works.
-      throw PlexException(__LINE__, "dependency conflict");
+  std::deque<XEntity*> ordered;
+  while (!ready.empty()) {
+    auto ix = *begin(ready);
+    ready.erase(begin(ready));
+    ordered.push_back(code[ix]);
+    for (auto d : dependents[ix]) {
+      if (--pending[d] == 0)
+        ready.insert(d);
     }
   }
 
+  if (ordered.size() != count)
+    throw DependencyException(__LINE__, FindDependencyCycle(code, deps, pending));
+
+  code.swap(ordered);
+}
+
+void ProcessEntities(CppTokenVector& in_src, XEntities& ent) {
+  std::sort(begin(ent.includes), end(ent.includes), 
+      [] (const XInclude& e1, const XInclude& e2) {
+        return e1.Order(e2);
+      }
+  );
+
+  OrderCodeEntities(ent.code);
+
   // Insert includes after the first include.
-  auto& kel = *in_src[0].kelems;
+  auto& kel = *in_src[0].kelems();
   auto fik = kel.includes.find(Range<char>(first_include_key));
   const auto pos_include = (fik != end(kel.includes)) ? fik->second : 1;
 
@@ -2284,7 +4988,7 @@ void ProcessEntities(CppTokenVector& in_src, XEntities& ent) {
 
   // collect all the plex metadata from #pragma annotations of all dependents.
   for (auto& e : ent.code) {
-    auto x = e->tv->at(0).kelems;
+    auto x = e->tv->at(0).kelems();
     if (!x)
       continue;
     for (auto& p : x->properties) {
@@ -2312,7 +5016,7 @@ void ProcessEntities(CppTokenVector& in_src, XEntities& ent) {
 
   for (auto& cod : ent.code) {
     Logger::Get().ProcessCode(cod->name);
-    auto& scopes = (*cod->tv)[0].kelems->scopes;
+    auto& scopes = (*cod->tv)[0].kelems()->scopes;
 
     auto& top_scope = scopes.back();
     if (top_scope.type == ScopeBlock::named_namespace) {
@@ -2323,20 +5027,20 @@ void ProcessEntities(CppTokenVector& in_src, XEntities& ent) {
       } else {
         // Insert has the same namespace as the previous one, we
         // need to collapse them, by removing previous insert.
-        auto& exv = in_src[pos_code].insert->tv;
-        auto revit = rbegin(exv);
-        while (revit != rend(exv)) {
-          if (revit->type == CppToken::close_cur_bracket) {
-            revit->insert = Insert::TokenDeleter();
+        auto& exv = in_src[pos_code].insert()->tv;
+        auto revit = end(exv);
+        while (revit != begin(exv)) {
+          if ((--revit)->type() == CppToken::close_cur_bracket) {
+            revit->set_insert(Insert::TokenDeleter());
             break;
           }
         }
         // Then remove the namespace from this insert. Which means
         // the tree tokens "namespace xxx {".
         size_t rp = top_scope.start;
-        (*cod->tv)[rp--].insert = Insert::TokenDeleter();
-        (*cod->tv)[rp--].insert = Insert::TokenDeleter();
-        (*cod->tv)[rp].insert = Insert::TokenDeleter();
+        (*cod->tv)[rp--].set_insert(Insert::TokenDeleter());
+        (*cod->tv)[rp--].set_insert(Insert::TokenDeleter());
+        (*cod->tv)[rp].set_insert(Insert::TokenDeleter());
 
       }
     } else {
@@ -2349,18 +5053,268 @@ void ProcessEntities(CppTokenVector& in_src, XEntities& ent) {
 
 }
 
+// A part of a catalog entity that SplitEntities() moves to the cc file: either a
+// nested namespace block, which is moved whole, or the definition of an exportable
+// free function, whose body is moved and whose header part becomes a declaration.
+struct SplitPiece {
+  enum Type { nested_namespace, function };
+
+  Type type;
+  size_t start;    // First token.
+  size_t end;      // One past the last token.
+  size_t name;     // Function: the name token.
+  size_t body;     // Function: the "{" that starts the body.
+  Atom ns;         // The namespace the piece goes in, if any.
+  ScopeBlock ens;
+
+  SplitPiece(size_t start, size_t end, Atom ns, const ScopeBlock& ens)
+      : type(nested_namespace), start(start), end(end), name(0), body(0),
+        ns(ns), ens(ens) {}
+
+  SplitPiece(size_t start, size_t end, size_t name, size_t body, Atom ns,
+             const ScopeBlock& ens)
+      : type(function), start(start), end(end), name(name), body(body),
+        ns(ns), ens(ens) {}
+};
+
+std::vector<SplitPiece> FindSplitPieces(XEntity* ent) {
+  std::vector<SplitPiece> pieces;
+
+  // The exportable names are kept as the atoms of the namespace and of the name.
+  auto DefKey = [](Atom ns, Atom name) -> uint64_t {
+    return (static_cast<uint64_t>(ns) << 32) | name;
+  };
+
+  auto& tv = ent->tv;
+  auto& comments = (*tv)[0].kelems()->plex_comments;
+  auto& path = (*tv)[0].kelems()->src_path;
+  std::set<uint64_t> defset;
+
+  for (auto& c : comments) {
+    if (c.size() < 10)
+      continue;
+    auto spl = SplitStdString(c);
+    if (spl.size() != 2)
+      continue;
+    if (spl[0] != "//#~def")
+      continue;
+    auto sep = spl[1].rfind("::");
+    if ((sep == std::string::npos) || !sep)
+      continue;
+    auto name = FromString(spl[1]);
+    defset.insert(DefKey(
+        Atoms::Get().Intern(Range<char>(name.Start(), name.Start() + sep)),
+        Atoms::Get().Intern(Range<char>(name.Start() + sep + 2, name.End()))));
+  }
+
+  auto kelems = (*tv)[0].kelems();
+
+  auto FindEnclosingNS = [kelems](size_t pos) -> ScopeBlock {
+    auto s = kelems->EnclosingScope(pos, ScopeBlock::named_namespace);
+    return s ? *s : ScopeBlock(ScopeBlock::none);
+  };
+
+  auto InEnclosingAggregate = [kelems](size_t pos) -> bool {
+    return kelems->EnclosingScope(pos, ScopeBlock::block_aggregate) != nullptr;
+  };
+
+  auto GetEndScopeFromStart = [kelems](size_t start) -> size_t {
+    auto s = kelems->ScopeAt(start);
+    return s ? s->end : 0;
+  };
+
+  auto GetNamespaceFromStart = [kelems](size_t start) -> ScopeBlock {
+    auto s = kelems->ScopeAt(start);
+    if (s && (s->type == ScopeBlock::named_namespace))
+      return *s;
+    return ScopeBlock(ScopeBlock::none);
+  };
+
+  // Finding freestanding functions consists of finding "(" and then looking at the previous
+  // token, if is an identifier and the identifier (full name) is in the ~def set then it is
+  // elegible, then we need to find the enclosing scope and figure out it is not a struct or
+  // class definition.
+  for (auto it = begin(*tv); it != end(*tv); ++it) {
+    if (it->type() != CppToken::open_paren)
+      continue;
+    auto it2 = it - 1;
+    if (it2->type() != CppToken::identifier)
+      continue;
+    // find right above namespace.
+    size_t name_pos = it2 - begin(*tv);
+    auto ens = FindEnclosingNS(name_pos);
+    if (ens.type == ScopeBlock::none)
+      throw TokenizerException(path.Raw(), __LINE__, it2->line());
+
+    auto cns = Atoms::Get().Intern(ens.name);
+    if (!defset.count(DefKey(cns, AtomOf(*it2)))) {
+      // Not an exportable name, but if part of a nested namespace then
+      // we should move the whole namespace block to the cc file.
+      if (ens.top) {
+        auto pns = GetNamespaceFromStart(ens.top);
+        auto pns_atom = (pns.type == ScopeBlock::none) ?
+            Atoms::kNone : Atoms::Get().Intern(pns.name);
+        pieces.push_back(SplitPiece(ens.start - 2, ens.end + 1, pns_atom, pns));
+        it = begin(*tv) + ens.end + 1;
+      }
+      continue;
+    }
+
+    // Easy check: it is not a destructor.
+    if ((it2 - 1)->type() == CppToken::bitwise_not)
+      continue;
+
+    if (InEnclosingAggregate(name_pos))
+      continue;
+
+    // found a freestanding external function. Find out if it is a template.
+    // we scan backwards until "}", "{" or ";" is found.
+    auto it3 = it2 - 1;
+    for (; (it3->type() != CppToken::close_cur_bracket) &&
+           (it3->type() != CppToken::open_cur_bracket) &&
+           (it3->type() != CppToken::semicolon) &&
+           (it3->type() != CppToken::prep_pragma);
+           --it3) {
+      if (it3->type() == CppToken::sos)
+        throw TokenizerException(path.Raw(), __LINE__, it2->line());
+    }
+    // Now scan forward until the name is reached or template is found.
+    auto it4 = it3;
+    for (; it4 != it2; ++it4) {
+      if (it4->type() == CppToken::kw_template)
+        break;
+    }
+    if (it4->type() == CppToken::kw_template)
+      continue;
+    // Not a template. The declaration starts at it3 + 1 and ends before "{".
+    auto it5 = it2;
+    for (; (it5->type() != CppToken::open_cur_bracket) &&
+           (it5->type() != CppToken::semicolon); 
+         ++it5) {
+      if (it5->type() == CppToken::sos)
+        throw TokenizerException(path.Raw(), __LINE__, it2->line());
+    }
+    // Make sure it is not a declaration.
+    if (it5->type() == CppToken::semicolon)
+      continue;
+
+    size_t def_begin = it5 - begin(*tv);
+    auto def_end = GetEndScopeFromStart(def_begin);
+    if (!def_end)
+      throw TokenizerException(path.Raw(), __LINE__, it5->line());
+
+    // $$$ this code only supports one top level namespace.
+    if (ens.top)
+      throw TokenizerException(path.Raw(), __LINE__, it5->line());
+
+    pieces.push_back(SplitPiece(it3 + 1 - begin(*tv), def_end + 1,
+                                name_pos, def_begin, cns, ens));
+    it = begin(*tv) + def_end + 1;
+  }
+  return pieces;
+}
+
+// Returns the atom of the unqualified part of |tok|, for example "Foo" for
+// "plx::Foo", or kNone if that name was never interned.
+Atom FindNameAtom(CppTokenConstRef tok) {
+  auto start = tok.range().Start();
+  for (auto p = tok.range().Start(); p + 1 < tok.range().End(); ++p) {
+    if ((p[0] == ':') && (p[1] == ':'))
+      start = p + 2;
+  }
+  return Atoms::Get().Find(Range<char>(start, tok.range().End()));
+}
+
+// Finds which of the functions in |pieces| are used. A function is used when
+// its name appears in the |users|, in any entity outside the split functions,
+// or in the definition of a used function. Names are compared unqualified, so
+// an overload or a same-named member keeps a function alive, never the reverse.
+std::unordered_set<Atom> FindUsedFunctions(std::deque<XEntity*>& code,
+                                           std::vector<std::vector<SplitPiece>>& pieces,
+                                           const std::vector<CppTokenVector*>& users) {
+  // The definitions of each candidate name.
+  std::unordered_map<Atom, std::vector<std::pair<CppTokenVector*, SplitPiece*>>> defs;
+  for (size_t ix = 0; ix != code.size(); ++ix) {
+    for (auto& piece : pieces[ix]) {
+      if (piece.type == SplitPiece::function)
+        defs[AtomOf((*code[ix]->tv)[piece.name])].push_back(
+            std::make_pair(code[ix]->tv, &piece));
+    }
+  }
+
+  std::unordered_set<Atom> used;
+  std::vector<Atom> pending;
+
+  auto Scan = [&](const CppTokenVector& tv, size_t start, size_t end, size_t skip) {
+    for (size_t ix = start; ix != end; ++ix) {
+      if ((ix == skip) || (tv[ix].type() != CppToken::identifier))
+        continue;
+      auto atom = FindNameAtom(tv[ix]);
+      if ((atom == Atoms::kNone) || !defs.count(atom))
+        continue;
+      if (used.insert(atom).second)
+        pending.push_back(atom);
+    }
+  };
+
+  for (auto user : users)
+    Scan(*user, 0, user->size(), user->size());
+
+  for (size_t ix = 0; ix != code.size(); ++ix) {
+    auto& tv = *code[ix]->tv;
+    size_t pos = 0;
+    for (auto& piece : pieces[ix]) {
+      if (piece.type != SplitPiece::function)
+        continue;
+      Scan(tv, pos, piece.start, tv.size());
+      pos = piece.end;
+    }
+    Scan(tv, pos, tv.size(), tv.size());
+  }
+
+  while (!pending.empty()) {
+    auto atom = pending.back();
+    pending.pop_back();
+    for (auto& def : defs[atom])
+      Scan(*def.first, def.second->start, def.second->end, def.second->name);
+  }
+  return used;
+}
+
+// Moves the exportable function definitions and the nested namespaces of |code| to
+// the |cpp_dests|. If there are |users| then the functions they don't use are dropped.
+// With several destinations each entity goes whole, in order, to the one with the
+// fewest tokens so far, a nested namespace is only used by the functions after it.
 void SplitEntities(std::deque<XEntity*>& code,
                    std::deque<XInclude>& xincl,
-                   CppTokenVector& cpp_dest) {
-  auto& includes = cpp_dest[0].kelems->includes;
-  auto lik = includes.find(Range<char>(last_include_key));
-  const auto pos_code = (lik != end(includes)) ? lik->second : 1;
+                   std::vector<CppTokenVector>& cpp_dests,
+                   const std::vector<CppTokenVector*>& users) {
+  struct Shard {
+    CppTokenVector* tv;
+    size_t pos_code;
+    Atom last_namespace;
+    size_t tokens;
+  };
+
+  std::vector<Shard> shards;
+  for (auto& cpp_dest : cpp_dests) {
+    auto& includes = cpp_dest[0].kelems()->includes;
+    auto lik = includes.find(Range<char>(last_include_key));
+    const size_t pos_code = (lik != end(includes)) ? lik->second : 1;
+    Shard shard = { &cpp_dest, pos_code, Atoms::kNone, 0 };
+    shards.push_back(shard);
+  }
+
+  auto Emit = [](Shard& shard, CppTokenVector itv) -> void {
+    InsertAtToken((*shard.tv)[shard.pos_code], Insert::keep_original, itv);
+    shard.tokens += itv.size();
+  };
 
-  auto InsertSingleBracket = [&cpp_dest, &pos_code]() -> void {
-    auto close_bracket =  new std::string("}");
+  auto InsertSingleBracket = [&Emit](Shard& shard) -> void {
+    auto close_bracket = RunArena().New<std::string>("}");
     CppToken newtoken(FromString(*close_bracket), CppToken::close_cur_bracket, 1, 1);
     CppTokenVector itv = {newtoken};
-    InsertAtToken(cpp_dest[pos_code], Insert::keep_original, itv);
+    Emit(shard, itv);
   };
 
   // Insert the library records. They come from the index.plex as the second item
@@ -2372,230 +5326,96 @@ void SplitEntities(std::deque<XEntity*>& code,
     incl.backing_library += "\")";
     CppToken newtoken(FromString(incl.backing_library), CppToken::prep_pragma, 1, 1);
     CppTokenVector itv = {newtoken};
-    InsertAtToken(cpp_dest[pos_code], Insert::keep_original, itv);
+    Emit(shards[0], itv);
   }
 
-  std::string last_namespace;
-
-  for (XEntity* ent : code) {
-    auto& tv = ent->tv;
-    auto& comments = (*tv)[0].kelems->plex_comments;
-    auto& scopes = (*tv)[0].kelems->scopes;
-    auto& path = (*tv)[0].kelems->src_path;
-    std::set<std::string> defset;
-
-    for (auto& c : comments) {
-      if (c.size() < 10)
-        continue;
-      auto spl = SplitStdString(c);
-      if (spl.size() != 2)
-        continue;
-      if (spl[0] == "//#~def")
-        defset.emplace(spl[1]);
-    }
-
-    auto FindEnclosingNS = [&scopes](size_t pos) -> ScopeBlock {
-      ScopeBlock* sb;
-      size_t best = 0;
-
-      for (auto& s : scopes) {
-        if (s.type != ScopeBlock::named_namespace)
-          continue;
-        if ((s.start < pos) && (s.end > pos)) {
-          if (s.start > best) {
-            sb = &s;
-            best = s.start;
-          }
-        }
-      }
-      return sb ? *sb : ScopeBlock(ScopeBlock::none);
-    };
-
-    auto InEnclosingAggregate = [&scopes](size_t pos) -> bool {
-      for (auto& s : scopes) {
-        if (s.type != ScopeBlock::block_aggregate)
-          continue;
-        if ((s.start < pos) && (s.end > pos))
-          return true;
-      }
-      return false;
+  std::vector<std::vector<SplitPiece>> pieces;
+  for (XEntity* ent : code)
+    pieces.push_back(FindSplitPieces(ent));
+
+  std::unordered_set<Atom> used;
+  if (!users.empty())
+    used = FindUsedFunctions(code, pieces, users);
+
+  for (size_t ix = 0; ix != code.size(); ++ix) {
+    auto& tv = *code[ix]->tv;
+    auto& shard = *std::min_element(begin(shards), end(shards),
+        [](const Shard& s1, const Shard& s2) {
+          return s1.tokens < s2.tokens;
+        });
+
+    // Before adding the code lets add the namespace if needed.
+    auto OpenNamespace = [&](const SplitPiece& piece) {
+      if ((piece.ns == Atoms::kNone) || (shard.last_namespace == piece.ns))
+        return;
+      if (shard.last_namespace != Atoms::kNone)
+        InsertSingleBracket(shard);
+
+      auto itC = begin(tv) + piece.ens.start - 2;
+      auto itD = begin(tv) + piece.ens.start + 1;
+      Emit(shard, CppTokenVector(itC, itD));
+      shard.last_namespace = piece.ns;
     };
 
-    auto GetEndScopeFromStart = [&scopes](size_t start) -> size_t {
-      for (auto& s : scopes) {
-        if (s.start != start)
-          continue;
-        return s.end;
-      }
-      return 0;
-    };
+    for (auto& piece : pieces[ix]) {
+      auto it3 = begin(tv) + piece.start;
+      auto it6 = begin(tv) + piece.end;
 
-    // Finding freestanding functions consists of finding "(" and then looking at the previous
-    // token, if is an identifier and the identifier (full name) is in the ~def set then it is
-    // elegible, then we need to find the enclosing scope and figure out it is not a struct or
-    // class definition.
-    for (auto it = begin(*tv); it != end(*tv); ++it) {
-      if (it->type != CppToken::open_paren)
-        continue;
-      auto it2 = it - 1;
-      if (it2->type != CppToken::identifier)
-        continue;
-      // find right above namespace.
-      size_t name_pos = it2 - begin(*tv);
-      size_t ens_pos = 0;
-      auto ens = FindEnclosingNS(name_pos);
-      if (ens.type == ScopeBlock::none)
-        throw TokenizerException(path.Raw(), __LINE__, it2->line);
-
-      auto cns = ToString(ens.name);
-      auto fqname = cns + "::" + ToString(*it2);
-      if (!defset.count(fqname)) {
-        // Not an exportable name, but if part of a nested namespace then
-        // we should move the whole namespace block to the cc file.
-        if (ens.top) {
-          auto itA = begin(*tv) + ens.start - 2;
-          auto itB = begin(*tv) + ens.end + 1;
-          InsertAtToken(cpp_dest[pos_code], Insert::keep_original, CppTokenVector(itA, itB));
-          for (; itA != itB; ++itA) {
-            itA->insert = Insert::TokenDeleter();
-          }
-          it = itB;
+      if (piece.type == SplitPiece::nested_namespace) {
+        OpenNamespace(piece);
+        Emit(shard, CppTokenVector(it3, it6));
+        for (; it3 != it6; ++it3) {
+          it3->set_insert(Insert::TokenDeleter());
         }
         continue;
       }
 
-      // Easy check: it is not a destructor.
-      if ((it2 - 1)->type == CppToken::bitwise_not)
-        continue;
-
-      if (InEnclosingAggregate(name_pos))
-        continue;
-
-      // found a freestanding external function. Find out if it is a template.
-      // we scan backwards until "}", "{" or ";" is found.
-      auto it3 = it2 - 1;
-      for (; (it3->type != CppToken::close_cur_bracket) &&
-             (it3->type != CppToken::open_cur_bracket) &&
-             (it3->type != CppToken::semicolon) &&
-             (it3->type != CppToken::prep_pragma);
-             --it3) {
-        if (it3->type == CppToken::sos)
-          throw TokenizerException(path.Raw(), __LINE__, it2->line);
-      }
-      // Now scan forward until the name is reached or template is found.
-      auto it4 = it3;
-      for (; it4 != it2; ++it4) {
-        if (it4->type == CppToken::kw_template)
-          break;
-      }
-      if (it4->type == CppToken::kw_template)
-        continue;
-      // Not a template.
-      // We need to construct a declaration out of the definition
-      // that starts at it3 + 1 and ends before "{".
-      auto it5 = it2;
-      for (; (it5->type != CppToken::open_cur_bracket) &&
-             (it5->type != CppToken::semicolon); 
-           ++it5) {
-        if (it5->type == CppToken::sos)
-          throw TokenizerException(path.Raw(), __LINE__, it2->line);
-      }
-      // Make sure it is not a declaration.
-      if (it5->type == CppToken::semicolon)
-        continue;
-
-      it3++;
-      it5--;
-      Range<char> decl(it3->range.Start(), it5->range.End());
+      auto it5 = begin(tv) + piece.body;
+      Range<char> decl(it3->range().Start(), (it5 - 1)->range().End());
       Logger::Get().ProcessSplitDecl(decl);
-      ++it5;
 
-      size_t def_begin = it5 - begin(*tv);
-      auto def_end = GetEndScopeFromStart(def_begin);
-      if (!def_end)
-        throw TokenizerException(path.Raw(), __LINE__, it5->line);
-
-      // Before adding the code lets add the namespace if needed.
-      // $$$ this code only supports one top level namespace.
-      if (ens.top) {
-        throw TokenizerException(path.Raw(), __LINE__, it5->line);
+      if (!users.empty() && !used.count(AtomOf(tv[piece.name]))) {
+        // Nobody calls it, the declaration stays but the definition is gone.
+        Logger::Get().ProcessPrunedDef(tv[piece.name].range());
       } else {
-        if (last_namespace != cns) {
-          if (!last_namespace.empty())
-            InsertSingleBracket();
- 
-          auto itC = begin(*tv) + ens.start - 2;
-          auto itD = begin(*tv) + ens.start + 1;
-          InsertAtToken(cpp_dest[pos_code], Insert::keep_original, CppTokenVector(itC, itD));
-          last_namespace = cns;
-        }
+        OpenNamespace(piece);
+        // insert the definition into the cc file.
+        Emit(shard, CppTokenVector(it3, it6));
       }
 
-      // insert the definition into the cc file.
-      auto it6 = begin(*tv) + def_end + 1;
-      InsertAtToken(cpp_dest[pos_code], Insert::keep_original, CppTokenVector(it3, it6));
-
       // Mutate the start of definition "{" into a semicolon.
-      it5->type = CppToken::semicolon;
-      it5->range = Range<char>(handy_semicolon, handy_semicolon + 1);
+      it5->set_type(CppToken::semicolon);
+      it5->set_range(Range<char>(handy_semicolon, handy_semicolon + 1));
 
       // Remove the rest of the definition.
       ++it5;
       for (; it5 != it6; ++it5) {
-        it5->insert = Insert::TokenDeleter();
+        it5->set_insert(Insert::TokenDeleter());
       }
-
-      it = it6;
     }
   }
   // Close any outstanding namespace.
-  if (!last_namespace.empty())
-    InsertSingleBracket();
+  for (auto& shard : shards) {
+    if (shard.last_namespace != Atoms::kNone)
+      InsertSingleBracket(shard);
+  }
 }
 
-void ProcessEntities2(CppTokenVector& header_dest, CppTokenVector& cpp_dest, XEntities& ent) {
+// The code is split between the |cpp_dests|, which all include |header_dest|. If |user|
+// is not null the exportable functions that it doesn't need are left out of them. Their
+// declarations stay in |header_dest|.
+void ProcessEntities2(CppTokenVector& header_dest, std::vector<CppTokenVector>& cpp_dests,
+                      XEntities& ent, CppTokenVector* user = nullptr) {
   std::sort(begin(ent.includes), end(ent.includes), 
       [] (const XInclude& e1, const XInclude& e2) {
         return e1.Order(e2);
       }
   );
 
-  std::sort(begin(ent.code), end(ent.code), 
-      [] (const XEntity* e1, const XEntity* e2) {
-        return e1->Order(*e2);
-      }
-  );
-
-  // Lazy attempt to re-order the code if the dependency order
-  // is wrong. Easy to detect but hard to fix completely. We try
-  // several times exchanging the order.
-  if (ent.code.size() > 1) {
-    int tries = 70;
-    bool go_again = true;
-    while ((--tries != 0) && go_again) {
-      go_again = false;
-      for (auto ix = begin(ent.code); ix != end(ent.code); ++ix) {
-        for (auto& d : (*ix)->deps) {
-          auto xd = std::find(ix + 1, end(ent.code), d);
-          if (xd != end(ent.code)) {
-            // Sort order is wrong, a dependency is below.
-            std::swap(*ix, *xd);
-            go_again = true;
-            goto leave;
-          }
-        }
-      }
-      leave: ;
-    }  // while.
-
-    if (go_again) {
-      // we could not find an arrangement of code inserts that works.
-      throw PlexException(__LINE__, "dependency conflict");
-    }
-  }
+  OrderCodeEntities(ent.code);
 
   // Insert includes after the first include.
-  auto& kel = *header_dest[0].kelems;
+  auto& kel = *header_dest[0].kelems();
   auto fik = kel.includes.find(Range<char>(first_include_key));
   const auto pos_include = (fik != end(kel.includes)) ? fik->second : 1;
 
@@ -2616,7 +5436,7 @@ void ProcessEntities2(CppTokenVector& header_dest, CppTokenVector& cpp_dest, XEn
 
   // collect all the plex metadata from #pragma annotations of all dependents.
   for (auto& e : ent.code) {
-    auto x = e->tv->at(0).kelems;
+    auto x = e->tv->at(0).kelems();
     if (!x)
       continue;
     for (auto& p : x->properties) {
@@ -2636,7 +5456,14 @@ void ProcessEntities2(CppTokenVector& header_dest, CppTokenVector& cpp_dest, XEn
     }
   }
 
-  SplitEntities(ent.code, ent.includes, cpp_dest);
+  std::vector<CppTokenVector*> users;
+  if (user) {
+    users.push_back(user);
+    users.push_back(&header_dest);
+    for (auto& cpp_dest : cpp_dests)
+      users.push_back(&cpp_dest);
+  }
+  SplitEntities(ent.code, ent.includes, cpp_dests, users);
 
   // Insert code after the integer definitions.
   auto lik = kel.includes.find(Range<char>(last_include_key));
@@ -2645,7 +5472,7 @@ void ProcessEntities2(CppTokenVector& header_dest, CppTokenVector& cpp_dest, XEn
   Range<char> curr_namespace;
   for (auto& cod : ent.code) {
     Logger::Get().ProcessCode(cod->name);
-    auto& scopes = (*cod->tv)[0].kelems->scopes;
+    auto& scopes = (*cod->tv)[0].kelems()->scopes;
 
     auto& top_scope = scopes.back();
     if (top_scope.type == ScopeBlock::named_namespace) {
@@ -2656,20 +5483,20 @@ void ProcessEntities2(CppTokenVector& header_dest, CppTokenVector& cpp_dest, XEn
       } else {
         // Insert has the same namespace as the previous one, we
         // need to collapse them, by removing previous insert.
-        auto& exv = header_dest[pos_code].insert->tv;
-        auto revit = rbegin(exv);
-        while (revit != rend(exv)) {
-          if (revit->type == CppToken::close_cur_bracket) {
-            revit->insert = Insert::TokenDeleter();
+        auto& exv = header_dest[pos_code].insert()->tv;
+        auto revit = end(exv);
+        while (revit != begin(exv)) {
+          if ((--revit)->type() == CppToken::close_cur_bracket) {
+            revit->set_insert(Insert::TokenDeleter());
             break;
           }
         }
         // Then remove the namespace from this insert. Which means
         // the tree tokens "namespace xxx {".
         size_t rp = top_scope.start;
-        (*cod->tv)[rp--].insert = Insert::TokenDeleter();
-        (*cod->tv)[rp--].insert = Insert::TokenDeleter();
-        (*cod->tv)[rp].insert = Insert::TokenDeleter();
+        (*cod->tv)[rp--].set_insert(Insert::TokenDeleter());
+        (*cod->tv)[rp--].set_insert(Insert::TokenDeleter());
+        (*cod->tv)[rp].set_insert(Insert::TokenDeleter());
 
       }
     } else {
@@ -2683,79 +5510,315 @@ void ProcessEntities2(CppTokenVector& header_dest, CppTokenVector& cpp_dest, XEn
 }
 
 int CountInnerLFs(Range<char> range) {
-  if (!range.Size())
-    return 0;
+  return static_cast<int>(std::count(range.Start(), range.End(), '\n'));
+}
 
-  int count = 0; 
-  auto r = range.Start();
-  while(r) {
-    if (*r == '\n')
-      ++count;
-    range.Next(r);
+// Accumulates the generated source in a large buffer and writes it to the file
+// in big chunks, instead of one allocation and one WriteFile per token. Without
+// a file the whole output is kept in memory. |path| names the file in errors.
+class OutputWriter {
+  File* file_;
+  const std::wstring path_;
+  std::vector<char> buf_;
+  size_t used_;
+  size_t written_;
+
+  static const size_t kMaxBuffer = 16 * 1024 * 1024;
+
+public:
+  OutputWriter(File* file, const std::wstring& path, size_t size_hint)
+      : file_(file),
+        path_(path),
+        buf_(std::max<size_t>(file ? std::min(size_hint, kMaxBuffer) : size_hint, 4096)),
+        used_(0),
+        written_(0) {
   }
-  return count;
+
+  void Append(const char* str, size_t size) {
+    if (size > (buf_.size() - used_)) {
+      if (!file_) {
+        buf_.resize(std::max(buf_.size() * 2, used_ + size));
+        memcpy(&buf_[used_], str, size);
+        used_ += size;
+        return;
+      }
+      Flush();
+      if (size > buf_.size()) {
+        Write(str, size);
+        return;
+      }
+    }
+    memcpy(&buf_[used_], str, size);
+    used_ += size;
+  }
+
+  void Append(const Range<char>& r) {
+    Append(r.Start(), r.Size());
+  }
+
+  // Appends |count| copies of |c| which must be a space or a linefeed. They
+  // come from static runs so no temporary is needed.
+  void AppendRun(char c, size_t count) {
+    static const char spaces[] =
+        "                                                                ";
+    static const char linefeeds[] =
+        "\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n\n";
+    const char* run = (c == ' ') ? spaces : linefeeds;
+    const size_t run_size = ((c == ' ') ? sizeof(spaces) : sizeof(linefeeds)) - 1;
+    while (count) {
+      size_t n = std::min(count, run_size);
+      Append(run, n);
+      count -= n;
+    }
+  }
+
+  void Flush() {
+    if (!used_ || !file_)
+      return;
+    Write(&buf_[0], used_);
+    used_ = 0;
+  }
+
+  // Only valid for in-memory writers.
+  std::string ToString() const {
+    return std::string(buf_.begin(), buf_.begin() + used_);
+  }
+
+  size_t BytesWritten() const {
+    return written_ + used_;
+  }
+
+private:
+  void Write(const char* str, size_t size) {
+    if (file_->Write(str, size, -1) != size)
+      throw IOException(__LINE__, path_.c_str(), "write");
+    written_ += size;
+  }
+};
+
+// Rough size of the generated output, used to size the OutputWriter buffer.
+size_t EstimateOutputSize(const CppTokenVector& src) {
+  size_t size = 0;
+  for (auto tok : src) {
+    // Each token is assumed to be preceded by about one separator.
+    size += tok.range().Size() + 1;
+    if (tok.col() && tok.insert() && (tok.type() != CppToken::sos))
+      size += EstimateOutputSize(tok.insert()->tv);
+  }
+  return size;
 }
 
-void WriteOutputFile(File& file, CppTokenVector& src, bool top = true) {
+void WriteTokens(OutputWriter& out, const CppTokenVector& src) {
   int line = 1;
   size_t column = 1;
 
   for (auto it = begin(src); it != end(src); ++it) {
-    if (!it->col)
+    if (!it->col())
       continue;
 
-    if (it->type == CppToken::none) {
-      line = it->line;
+    if (it->type() == CppToken::none) {
+      line = it->line();
       continue;
     }
 
-    std::string out;
-    int ldiff = it->line - line;
+    int ldiff = it->line() - line;
 
-    size_t cdiff =  ldiff ? it->col - 1 : it->col - column;
+    size_t cdiff =  ldiff ? it->col() - 1 : it->col() - column;
 
-    if ((ldiff > 2) && (it->line > 1)) {
-      int innlf = CountInnerLFs((it-1)->range);
+    if ((ldiff > 2) && (it->line() > 1)) {
+      int innlf = CountInnerLFs((it-1)->range());
       if (innlf) {
         ldiff = ldiff - innlf;
         cdiff = 0;
       }
     }
-    
-    out.append(ldiff, '\n');
-    out.append(cdiff, ' ');
-    out.append(ToString(it->range));
-
-    if (it->insert) {
-      if (it->insert->kind == Insert::keep_original) {
-        out.append(1, '\n');
-        file.Write(FromString(out));
+
+    if ((ldiff < 0) || (cdiff > CppToken::kMaxColumn))
+      throw PlexException(__LINE__, "token out of order");
+
+    if (it->insert()) {
+      if (it->insert()->kind == Insert::keep_original) {
+        out.AppendRun('\n', ldiff);
+        out.AppendRun(' ', cdiff);
+        out.Append(it->range());
+        out.AppendRun('\n', 1);
       }
-      WriteOutputFile(file, it->insert->tv, false);
+      WriteTokens(out, it->insert()->tv);
     }
     else {
-      file.Write(FromString(out));
+      out.AppendRun('\n', ldiff);
+      out.AppendRun(' ', cdiff);
+      out.Append(it->range());
+    }
+
+    line = it->line();
+    column = it->col() + it->range().Size();
+  }
+}
+
+// How the generated sources are written, from --minify.
+enum OutputStyle {
+  output_layout,          // The line and column layout of the sources.
+  output_minified,        // No comments and no more separators than needed.
+  output_minified_lines,  // Minified, with a #line where each entity starts.
+};
+
+OutputStyle output_style = output_layout;
+
+// Where WriteMinifiedTokens() is in the output.
+struct MinifyState {
+  // What can go next to each char without a space: the brackets go next to
+  // anything, the chars of words and literals next to punctuators.
+  enum Kind : unsigned char { bracket, word, punctuator };
+  Kind kind[256];
+  // The last char written, zero at the start.
+  char last;
+  // The end of the last token in its source, to tell if the next one was next to it.
+  const char* last_end;
+  // A #line is due before the next token.
+  bool marker;
+  // The line of a directive that goes on in the next line, zero otherwise.
+  int directive_line;
+
+  MinifyState() : last(0), last_end(nullptr), marker(output_style == output_minified_lines),
+                  directive_line(0) {
+    auto& table = GetCharClassTable();
+    for (int ix = 0; ix != 256; ++ix) {
+      auto cls = table.cls[ix];
+      kind[ix] = ((cls == cc_ident) || (cls == cc_non_ascii)) ? word : punctuator;
+    }
+    for (auto c : std::string(".\"'"))
+      kind[static_cast<unsigned char>(c)] = word;
+    // Nothing goes before the first token or at the start of a line.
+    for (auto c : std::string("()[]{};,\n"))
+      kind[static_cast<unsigned char>(c)] = bracket;
+    kind[0] = bracket;
+  }
+
+  // Whether a token that starts with |first| needs a space after |last|.
+  bool NeedsSpace(char first) const {
+    auto k = kind[static_cast<unsigned char>(last)];
+    return (k != bracket) && (k == kind[static_cast<unsigned char>(first)]);
+  }
+};
+
+// Writes |src| without comments, with a space only where two tokens would run
+// together and a line feed only around the preprocessor directives.
+void WriteMinifiedTokens(OutputWriter& out, const CppTokenVector& src, MinifyState& state) {
+  auto LineFeed = [&out, &state]() {
+    if (state.last && (state.last != '\n')) {
+      out.Append("\n", 1);
+      state.last = '\n';
+    }
+  };
+
+  auto Write = [&](CppTokenConstRef tok) {
+    if (state.marker) {
+      auto path = FindLoadedFile(tok.range().Start());
+      if (!path.empty()) {
+        std::string marker = "#line " + std::to_string(tok.line()) + " \"";
+        for (auto c : UTF16ToAscii(path)) {
+          if (c == '\\')
+            marker.push_back(c);
+          marker.push_back(c);
+        }
+        marker += "\"\n";
+        LineFeed();
+        out.Append(&marker[0], marker.size());
+        state.last = '\n';
+        state.marker = false;
+      }
+    }
+
+    // A directive that ends in "\" goes on in the next line. Its lines keep
+    // their line breaks, up to the first that does not end in "\".
+    if (state.directive_line && (tok.line() != state.directive_line)) {
+      if ((state.last == '\\') && (tok.line() != state.directive_line + 1)) {
+        // Nothing was written from the next line: a blank or a comment line.
+        out.Append("\n", 1);
+        state.last = '\n';
+      }
+      state.directive_line = (state.last == '\\') ? tok.line() : 0;
+      out.Append("\n", 1);
+      state.last = '\n';
+    }
+
+    const bool directive = (tok.type() > CppToken::prep_start) && (tok.type() < CppToken::prep_end);
+    if (directive) {
+      LineFeed();
+    } else if (state.NeedsSpace(tok.range()[0]) && (state.last_end != tok.range().Start())) {
+      out.Append(" ", 1);
+    }
+    out.Append(tok.range());
+    state.last = *(tok.range().End() - 1);
+    state.last_end = tok.range().End();
+    if (directive && (state.last == '\\')) {
+      state.directive_line = tok.line();
+    } else if (directive) {
+      out.Append("\n", 1);
+      state.last = '\n';
+    }
+  };
+
+  for (auto it = begin(src); it != end(src); ++it) {
+    if (!it->col()) {
+      // Each insertion starts with a control token.
+      if (it->type() == CppToken::plex_insert)
+        state.marker = (output_style == output_minified_lines);
+      continue;
     }
+    // A comment is dropped but not the code inserted at it.
+    const bool dropped = (it->type() == CppToken::none) || (it->type() == CppToken::comment) ||
+                         (it->type() == CppToken::plex_comment) || !it->range().Size();
+    if (it->insert()) {
+      if ((it->insert()->kind == Insert::keep_original) && !dropped)
+        Write(*it);
+      WriteMinifiedTokens(out, it->insert()->tv, state);
+      state.marker = (output_style == output_minified_lines);
+    } else if (!dropped) {
+      Write(*it);
+    }
+  }
+}
 
-    line = it->line;
-    column = it->col + it->range.Size();
+// Writes |src| in the --minify style or keeping its layout.
+void WriteStyledTokens(OutputWriter& out, const CppTokenVector& src) {
+  if (output_style == output_layout) {
+    WriteTokens(out, src);
+  } else {
+    MinifyState state;
+    WriteMinifiedTokens(out, src, state);
   }
-  if (top)
-    file.Write("\n");
+}
+
+void WriteOutputFile(File& file, const std::wstring& path, CppTokenVector& src) {
+  OutputWriter out(&file, path, EstimateOutputSize(src));
+  WriteStyledTokens(out, src);
+  out.AppendRun('\n', 1);
+  out.Flush();
+  plex_counters.bytes_written += out.BytesWritten();
+}
+
+std::string WriteOutputString(CppTokenVector& src) {
+  OutputWriter out(nullptr, std::wstring(), EstimateOutputSize(src));
+  WriteStyledTokens(out, src);
+  out.AppendRun('\n', 1);
+  plex_counters.bytes_written += out.BytesWritten();
+  return out.ToString();
 }
 
 #pragma region testing
 
 void DumpTokens(const CppTokenVector& src, std::ostream& oss);
 
-std::string DumpName(const CppToken& tok) {
-  return (tok.range.Size() ? ToString(tok.range) : std::string("<nullstr>"));
+std::string DumpName(CppTokenConstRef tok) {
+  return (tok.range().Size() ? ToString(tok.range()) : std::string("<nullstr>"));
 }
 
-void DumpToken(const CppToken& tok, std::ostream& oss) {
-  oss << std::setw(4) << tok.line << " {" << std::setw(3) << tok.type << "} ";
-  if (tok.col) {
-    oss << std::string(tok.col - 1, '_') << " " << DumpName(tok);
+void DumpToken(CppTokenConstRef tok, std::ostream& oss) {
+  oss << std::setw(4) << tok.line() << " {" << std::setw(3) << tok.type() << "} ";
+  if (tok.col()) {
+    oss << std::string(tok.col() - 1, '_') << " " << DumpName(tok);
   }
   else {
     oss << "<ctrl>";
@@ -2763,10 +5826,10 @@ void DumpToken(const CppToken& tok, std::ostream& oss) {
   oss << std::endl;
 }
 
-void DumpInsert(const CppToken& tok, std::ostream& oss) {
-  Insert& ins = *tok.insert;
+void DumpInsert(CppTokenConstRef tok, std::ostream& oss) {
+  Insert& ins = *tok.insert();
   if (ins.kind == Insert::delete_original) {
-    oss << "<deleted>" << " {" << std::setw(3) << tok.type << "} ";
+    oss << "<deleted>" << " {" << std::setw(3) << tok.type() << "} ";
     oss << DumpName(tok) << std::endl;
   } else {
     DumpToken(tok, oss);
@@ -2782,14 +5845,14 @@ void DumpTokens(const CppTokenVector& src, std::ostream& oss) {
   int item_no = 0;
   for (auto it = begin(src); it != end(src); ++it, ++item_no) {
     oss << std::setw(4) << item_no << ":";
-    if (it->type == CppToken::sos)
+    if (it->type() == CppToken::sos)
       oss << "[SOS]\n";
-    else if (it->type == CppToken::eos)
+    else if (it->type() == CppToken::eos)
       oss << "[EOS]\n";
-    else if (it->type == CppToken::none)
-      oss << "[NONE] (" << it->range.Size() << " chars elided)\n";
+    else if (it->type() == CppToken::none)
+      oss << "[NONE] (" << it->range().Size() << " chars elided)\n";
     else {
-      if (it->insert)
+      if (it->insert())
         DumpInsert(*it, oss);
       else
         DumpToken(*it, oss);
@@ -2813,34 +5876,200 @@ void DumpKeyElements(const KeyElements& kel, std::ostream& oss) {
   }
 }
 
-void GenerateDump(File& file, CppTokenVector& src) {
+std::string GenerateDumpString(CppTokenVector& src) {
   std::ostringstream oss;
   oss << "Plex Dump Version 001" << std::endl;
   oss << "token count: " << src.size() << std::endl;
   DumpTokens(src, oss);
-  DumpKeyElements(*src[0].kelems, oss);
-  file.Write(FromString(oss.str()));
+  DumpKeyElements(*src[0].kelems(), oss);
+  return oss.str();
+}
+
+void GenerateDump(File& file, CppTokenVector& src) {
+  file.Write(FromString(GenerateDumpString(src)));
 }
 
 #pragma endregion
 
-File MakeOutputCodeFile(const FilePath& out_path, std::wstring name) {
+File MakeOutputCodeFile(const FilePath& out_path, std::wstring name,
+                        std::vector<std::wstring>& outputs) {
   auto probe_path = out_path.Append(name);
   FilePath output_path = probe_path.Exists() ?
       out_path.Append(L"g_" + name) :
       probe_path;
-  return File::Create(output_path,
-                      FileParams::ReadWriteSharedRead(CREATE_ALWAYS),
-                      FileSecurity());
+  outputs.push_back(output_path.Raw());
+  File file = File::Create(output_path,
+                           FileParams::ReadWriteSharedRead(CREATE_ALWAYS),
+                           FileSecurity());
+  if (!file.IsValid())
+    throw IOException(__LINE__, output_path.Raw());
+  return file;
 }
 
-File MakeTestDumpFile(const FilePath& out_path, std::wstring name) {
+File MakeTestDumpFile(const FilePath& out_path, std::wstring name,
+                      std::vector<std::wstring>& outputs) {
   auto output_path = out_path.Append(name + L".dmp");
+  outputs.push_back(output_path.Raw());
   return File::Create(output_path,
                       FileParams::ReadWriteSharedRead(CREATE_ALWAYS),
                       FileSecurity());
 }
 
+#pragma region incremental
+
+std::string ToHex(uint64_t value) {
+  std::ostringstream oss;
+  oss << std::hex << std::setw(16) << std::setfill('0') << value;
+  return oss.str();
+}
+
+// Reads the whole |path| into |contents|. Returns false if it can't be read.
+bool ReadWholeFile(const FilePath& path, std::string& contents) {
+  File file = File::Create(path, FileParams::ReadSharedRead(), FileSecurity());
+  if (!file.IsValid())
+    return false;
+  contents.resize(file.SizeInBytes());
+  if (contents.empty())
+    return true;
+  auto range = FromString(contents);
+  return (file.Read(range, 0) == contents.size());
+}
+
+// Writes |contents| to |path|, always. Throws IOException if it can't.
+void WriteWholeFile(const FilePath& path, const std::string& contents) {
+  File file = File::Create(path,
+                           FileParams::ReadWriteSharedRead(CREATE_ALWAYS),
+                           FileSecurity());
+  if (!file.IsValid())
+    throw IOException(__LINE__, path.Raw());
+  if (file.Write(FromString(contents)) != contents.size())
+    throw IOException(__LINE__, path.Raw(), "write");
+}
+
+// Writes |contents| to |path| unless the file already has exactly these bytes,
+// so unchanged outputs keep their timestamp. Returns true if it wrote.
+bool WriteFileIfChanged(const FilePath& path, const std::string& contents) {
+  std::string existing;
+  if (ReadWholeFile(path, existing) && (existing == contents))
+    return false;
+  WriteWholeFile(path, contents);
+  return true;
+}
+
+// The manifest of an --incremental run records the hash of every file the run
+// read (the input, index.plex and the catalog files) and the outputs it made:
+//
+//   plex-manifest <plex build stamp>
+//   options <options>
+//   input <hash> <path>
+//   output <path>
+//
+// The next run with the same options exits early if nothing changed.
+class Manifest {
+public:
+  static bool IsCurrent(const FilePath& path, const std::string& options) {
+    std::string text;
+    if (!ReadWholeFile(path, text))
+      return false;
+
+    std::istringstream iss(text);
+    std::string line;
+    if (!std::getline(iss, line) || (line != Header()))
+      return false;
+    if (!std::getline(iss, line) || (line != ("options " + options)))
+      return false;
+
+    int inputs = 0;
+    while (std::getline(iss, line)) {
+      if (line.compare(0, 6, "input ") == 0) {
+        auto sp = line.find(' ', 6);
+        if (sp == std::string::npos)
+          return false;
+        Range<char> contents;
+        long long id;
+        auto& files = MappedFiles::Get();
+        if (!files.Acquire(FilePath(AsciiToUTF16(line.substr(sp + 1))), contents, id))
+          return false;
+        auto hash = HashFNV1a(contents);
+        files.Release(id);
+        if (line.compare(6, sp - 6, ToHex(hash)) != 0)
+          return false;
+        ++inputs;
+      } else if (line.compare(0, 7, "output ") == 0) {
+        if (!FilePath(AsciiToUTF16(line.substr(7))).Exists())
+          return false;
+      } else {
+        return false;
+      }
+    }
+    return (inputs != 0);
+  }
+
+  static void Write(const FilePath& path, const std::string& options,
+                    const std::vector<LoadedFile>& inputs,
+                    const std::vector<std::wstring>& outputs) {
+    std::string text = Header() + "\noptions " + options + "\n";
+    for (auto& lf : inputs) {
+      text += "input " + ToHex(HashFNV1a(lf.contents)) + " ";
+      text += UTF16ToAscii(lf.path) + "\n";
+    }
+    for (auto& out : outputs)
+      text += "output " + UTF16ToAscii(out) + "\n";
+    WriteFileIfChanged(path, text);
+  }
+
+private:
+  static std::string Header() {
+    return "plex-manifest " + ToHex(PlexBuildStamp());
+  }
+};
+
+// Writes a Make/Ninja depfile that says that |outputs| depend on |inputs|.
+void WriteDepfile(const FilePath& path, const std::vector<std::wstring>& outputs,
+                  const std::vector<std::wstring>& inputs) {
+  auto Escape = [](const std::wstring& name) -> std::string {
+    std::string escaped;
+    for (auto c : UTF16ToAscii(name)) {
+      if ((c == ' ') || (c == '#'))
+        escaped += '\\';
+      else if (c == '$')
+        escaped += '$';
+      escaped += c;
+    }
+    return escaped;
+  };
+
+  std::string text;
+  for (auto& out : outputs)
+    text += (text.empty() ? "" : " ") + Escape(out);
+  text += ":";
+  for (auto& in : inputs)
+    text += " \\\n  " + Escape(in);
+  text += "\n";
+  WriteWholeFile(path, text);
+}
+
+// Writes a generated source file. Outside incremental mode MakeOutputCodeFile()
+// picks the name. In incremental mode plex owns the file: it is written in
+// place, and only if its contents changed. A name that is taken by one of the
+// inputs, like the source or the stdafx templates, gets the "g_" prefix instead.
+void WriteGeneratedFile(const FilePath& out_path, const std::wstring& name,
+                        CppTokenVector& tv, bool incremental,
+                        std::vector<std::wstring>& outputs) {
+  if (!incremental) {
+    File file = MakeOutputCodeFile(out_path, name, outputs);
+    WriteOutputFile(file, outputs.back(), tv);
+    return;
+  }
+  auto path = out_path.Append(name);
+  if (IsLoadedFile(path))
+    path = out_path.Append(L"g_" + name);
+  WriteFileIfChanged(path, WriteOutputString(tv));
+  outputs.push_back(path.Raw());
+}
+
+#pragma endregion
+
 // ################################################################################################
 // #   main() entrypoint                                                                          #
 // #   plex.exe [options] cpp_file                                                                #
@@ -2853,81 +6082,782 @@ enum OpMode {
   PCHGen     = 1 << 2,
 };
 
-int wmain(int argc, wchar_t* argv[]) {
-  CmdLine cmdline(argc, argv);
-
+int GetOpMode(const CmdLine& cmdline) {
   int op_mode = None;
   if (cmdline.HasSwitch("dump-tree")) op_mode += TreeDump;
   if (cmdline.HasSwitch("generate")) op_mode += Generate;
   if (cmdline.HasSwitch("pch")) op_mode += PCHGen;
+  return op_mode;
+}
+
+// The catalog index is next to |input| unless --catalog says otherwise.
+FilePath GetCatalogIndex(const CmdLine& cmdline, const FilePath& input) {
+  auto cv = AsciiToUTF16(cmdline.Value("catalog"));
+  return cv.empty() ?
+      FilePath(input.Parent()).Append(L"catalog\\index.plex") :
+      FilePath(cv).Append(L"index.plex");
+}
+
+// The output directory is the one of |input| unless --out-dir says otherwise, in
+// which case it is created. Returns false if that fails.
+bool GetOutputDir(const CmdLine& cmdline, const FilePath& input, FilePath& out_path) {
+  auto out_path_str = AsciiToUTF16(cmdline.Value("out-dir"));
+  if (!out_path_str.empty()) {
+    if (!::CreateDirectoryW(out_path_str.c_str(), NULL)) {
+      if (::GetLastError() != ERROR_ALREADY_EXISTS)
+        return false;
+    }
+  } else {
+    out_path_str = input.Parent().Raw();
+  }
+  out_path = FilePath(out_path_str);
+  return true;
+}
+
+std::wstring FormatW(const wchar_t* fmt, ...) {
+  wchar_t buf[2048];
+  va_list args;
+  va_start(args, fmt);
+  vswprintf(buf, _countof(buf), fmt, args);
+  va_end(args);
+  return buf;
+}
+
+// Describes the exception in flight, which is about |input|, and logs it.
+std::wstring FailureText(const std::wstring& input) {
+  std::wstring text;
+  try {
+    throw;
+  } catch (TokenizerException& ex) {
+    text = FormatW(L"\nerror: [%s] Tokenizer error\n"
+                   L"in source line %d file [%s]\n"
+                   L"in program line %d, version (%S)\n",
+                   input.c_str(),
+                   ex.SourceLine(), ex.Path(),
+                   ex.Line(), __DATE__);
+
+    if (Logger::HasLogger())
+      Logger::Get().ReportException(ex);
+  
+  } catch (IOException& ex) {
+    text = FormatW(L"error: can't %S file [%s] (line %d)\n", ex.Action(), ex.Name(), ex.Line());
+
+    if (Logger::HasLogger())
+      Logger::Get().ReportException(ex);
+
+  } catch (DependencyException& ex) {
+    text = FormatW(L"\nerror: [%s] dependency cycle [%S]\n"
+                   L"in program line %d, version (%S)\n",
+                   input.c_str(), ex.Cycle(), ex.Line(), __DATE__);
+
+    if (Logger::HasLogger())
+      Logger::Get().ReportException(ex);
+
+  } catch (PlexException& ex) {
+    text = FormatW(L"\nerror: [%s] fatal exception [%S]\n"
+                   L"in program line %d, version (%S)\n",
+                   input.c_str(), ex.Message(), ex.Line(), __DATE__);
+
+    if (Logger::HasLogger())
+      Logger::Get().ReportException(ex);
+
+  } catch (std::exception& ex) {
+    text = FormatW(L"\nerror: [%s] fatal exception [%S]\n"
+                   L"version (%S)\n",
+                   input.c_str(), ex.what(), __DATE__);
+  }
+  return text;
+}
+
+// Prints the exception in flight, which is about |input|, and logs it.
+void ReportFailure(const std::wstring& input) {
+  auto text = FailureText(input);
+  std::lock_guard<std::mutex> lock(report_lock);
+  fputws(text.c_str(), stdout);
+}
+
+// Returns the input files: the command line extras with each @file replaced by
+// the paths it lists, one per line.
+std::vector<std::wstring> GetInputs(const CmdLine& cmdline) {
+  std::vector<std::wstring> inputs;
+  for (size_t ix = 0; !cmdline.Extra(ix).empty(); ++ix) {
+    auto extra = cmdline.Extra(ix);
+    if (extra[0] != L'@') {
+      inputs.push_back(extra);
+      continue;
+    }
+    std::string text;
+    if (!ReadWholeFile(FilePath(extra.substr(1)), text))
+      throw IOException(__LINE__, extra.c_str() + 1);
+    std::istringstream iss(text);
+    std::string line;
+    while (std::getline(iss, line)) {
+      auto last = line.find_last_not_of(" \t\r");
+      if (last == std::string::npos)
+        continue;
+      inputs.push_back(AsciiToUTF16(line.substr(0, last + 1)));
+    }
+  }
+  return inputs;
+}
+
+// --minify drops the layout of the generated sources, --minify=lines keeps track
+// of the entities with #line markers.
+OutputStyle GetOutputStyle(const CmdLine& cmdline) {
+  if (!cmdline.HasSwitch("minify"))
+    return output_layout;
+  return (cmdline.Value("minify") == "lines") ? output_minified_lines : output_minified;
+}
+
+// Prints the --stats report, or the --stats=json one.
+void ReportStats(const CmdLine& cmdline, const RunStats& stats, size_t entities) {
+  if (!cmdline.HasSwitch("stats"))
+    return;
+  if (cmdline.Value("stats") == "json")
+    printf("%s", stats.ToJson(entities).c_str());
+  else
+    printf("%s", stats.ToText(entities).c_str());
+}
+
+// Parses --define=<name>[=<value>],... A name without a value is defined to 1.
+std::map<std::string, long long> GetDefines(const CmdLine& cmdline) {
+  std::map<std::string, long long> defines;
+  std::istringstream iss(cmdline.Value("define"));
+  std::string item;
+  while (std::getline(iss, item, ',')) {
+    if (item.empty())
+      continue;
+    auto eq = item.find('=');
+    if (eq == std::string::npos)
+      defines[item] = 1;
+    else
+      defines[item.substr(0, eq)] = strtoll(item.c_str() + eq + 1, nullptr, 0);
+  }
+  return defines;
+}
+
+// Writes the generated file and the tree dump of an input processed in the
+// non PCH mode.
+void WriteUnitOutputs(const FilePath& out_path, const FilePath& path, CppTokenVector& cc_tv,
+                      int op_mode, bool incremental, std::vector<std::wstring>& outputs) {
+  if (op_mode & Generate)
+    WriteGeneratedFile(out_path, path.Leaf(), cc_tv, incremental, outputs);
+
+  if (op_mode & TreeDump) {
+    if (incremental) {
+      auto dump_path = out_path.Append(path.Leaf() + L".dmp");
+      WriteFileIfChanged(dump_path, GenerateDumpString(cc_tv));
+      outputs.push_back(dump_path.Raw());
+    } else {
+      File test_dump = MakeTestDumpFile(out_path, path.Leaf(), outputs);
+      GenerateDump(test_dump, cc_tv);
+    }
+  }
+}
+
+// Batch mode: every input is processed in the non PCH mode against one
+// SharedCatalog, on up to |jobs| threads. The outputs of each input go to
+// |out_dir|, or next to the input if it is null. Messages go to |report| if
+// there is one, else to stdout. Returns the number of failed inputs.
+size_t RunBatch(const std::vector<std::wstring>& inputs, SharedCatalog& shared,
+                const FilePath& catalog, const FilePath* out_dir, int op_mode,
+                bool incremental, const std::string& options,
+                TokenCache* cache, int jobs, size_t& entity_count,
+                std::wstring* report = nullptr) {
+  // Function statics are initialized before any thread runs.
+  GetCharClassTable();
+  GetIdentifierWordTable();
+  GetPreprocessorWordTable();
+  Insert::TokenDeleter();
+  Atoms::Get();
+
+  auto Report = [report](const std::wstring& text) {
+    std::lock_guard<std::mutex> lock(report_lock);
+    if (report)
+      report->append(text);
+    else
+      fputws(text.c_str(), stdout);
+  };
+
+  std::atomic<size_t> failures(0);
+  std::atomic<size_t> entities_used(0);
+  ParallelFor(inputs.size(), jobs, [&] (size_t ix) {
+    FilePath path(inputs[ix]);
+    try {
+      FilePath out_path(out_dir ? out_dir->Raw() : path.Parent().Raw());
+      FilePath manifest_path = out_path.Append(path.Leaf() + L".plexmf");
+      if (incremental && Manifest::IsCurrent(manifest_path, options)) {
+        Report(FormatW(L"plex: [%s] is up to date\n", path.Raw()));
+        return;
+      }
+
+      CppTokenVector cc_tv = TokenizeAndLexCpp(path, LexMode::PlainCPP);
+
+      XternDefs xdefs(shared.Definitions());
+      GetExternalDefinitions(cc_tv, xdefs);
+      XEntities entities = LoadEntities(xdefs, catalog.Parent(), cache, &shared);
+      entities.Dedup_Includes();
+      entities_used += entities.code.size() + entities.includes.size();
+
+      // The inputs of this unit, for its manifest. ProcessEntities() drops
+      // the key elements of the entities so they are collected first.
+      std::vector<LoadedFile> unit_inputs;
+      if (incremental) {
+        unit_inputs.push_back(LoadedFile(path.Raw(), LoadFileOnce(path)));
+        unit_inputs.push_back(LoadedFile(catalog.Raw(), LoadFileOnce(catalog)));
+        for (auto e : entities.code) {
+          auto& src = (*e->tv)[0].kelems()->src_path;
+          unit_inputs.push_back(LoadedFile(src.Raw(), LoadFileOnce(src)));
+        }
+      }
+
+      ProcessEntities(cc_tv, entities);
+
+      std::vector<std::wstring> outputs;
+      WriteUnitOutputs(out_path, path, cc_tv, op_mode, incremental, outputs);
+      if (incremental)
+        Manifest::Write(manifest_path, options, unit_inputs, outputs);
+
+    } catch (PlexException&) {
+      Report(FailureText(path.Raw()));
+      ++failures;
+    } catch (std::exception&) {
+      Report(FailureText(path.Raw()));
+      ++failures;
+    }
+  });
+  entity_count = entities_used;
+  return failures;
+}
+
+#pragma region server
+
+// Resident mode. "plex --serve[=name]" keeps a SharedCatalog in memory and
+// serves the requests that "plex --client[=name] <usual options>" sends over
+// the named pipe \\.\pipe\<name>. A request carries the client's current
+// directory and command line; the answer carries the exit code and the
+// messages. Requests are served one at a time and take the batch path, so
+// --pch is not available. Before each request the catalog files are checked
+// by write time and hash and the catalog is parsed again if any changed.
+
+std::wstring PipeName(const std::string& name) {
+  return L"\\\\.\\pipe\\" + AsciiToUTF16(name.empty() ? std::string("plex") : name);
+}
+
+// Longest request the server reads, in wchar_t. A request is the client
+// directory and its command line.
+const uint32_t kMaxRequest = 64 * 1024;
+
+// Time the server gives a client to send its request, and then to take the
+// answer, so that a stuck client can't block the build steps behind it.
+const DWORD kPipeTimeoutMs = 10 * 1000;
+
+// One ReadFile() or WriteFile() of up to |size| bytes. Without |ov| the call
+// blocks. With |ov| the pipe is overlapped and the call is cancelled and fails
+// if it has not finished by |deadline|, in GetTickCount64() time.
+bool PipeTransfer(HANDLE pipe, bool write, char* data, DWORD size, DWORD& done,
+                  OVERLAPPED* ov, ULONGLONG deadline) {
+  if (!ov) {
+    return write ? ::WriteFile(pipe, data, size, &done, nullptr) != 0 :
+                   ::ReadFile(pipe, data, size, &done, nullptr) != 0;
+  }
+  ::ResetEvent(ov->hEvent);
+  BOOL ok = write ? ::WriteFile(pipe, data, size, nullptr, ov) :
+                    ::ReadFile(pipe, data, size, nullptr, ov);
+  if (!ok && (::GetLastError() != ERROR_IO_PENDING))
+    return false;
+  auto now = ::GetTickCount64();
+  DWORD wait = (now < deadline) ? static_cast<DWORD>(deadline - now) : 0;
+  if (::WaitForSingleObject(ov->hEvent, wait) != WAIT_OBJECT_0) {
+    ::CancelIo(pipe);
+    ::GetOverlappedResult(pipe, ov, &done, TRUE);
+    return false;
+  }
+  return ::GetOverlappedResult(pipe, ov, &done, FALSE) != 0;
+}
+
+// Messages on the pipe are a 32-bit count of wchar_t followed by the text. The
+// server passes |ov| so that each message has kPipeTimeoutMs to go through.
+bool WriteMessage(HANDLE pipe, const std::wstring& msg, OVERLAPPED* ov = nullptr) {
+  const ULONGLONG deadline = ::GetTickCount64() + kPipeTimeoutMs;
+  uint32_t count = static_cast<uint32_t>(msg.size());
+  DWORD written;
+  if (!PipeTransfer(pipe, true, reinterpret_cast<char*>(&count), sizeof(count),
+                    written, ov, deadline) || (written != sizeof(count)))
+    return false;
+  const char* data = reinterpret_cast<const char*>(msg.data());
+  size_t left = count * sizeof(wchar_t);
+  while (left) {
+    if (!PipeTransfer(pipe, true, const_cast<char*>(data),
+                      static_cast<DWORD>(std::min<size_t>(left, 64 * 1024)),
+                      written, ov, deadline))
+      return false;
+    data += written;
+    left -= written;
+  }
+  return true;
+}
+
+// Fails for messages longer than |max_count|.
+bool ReadMessage(HANDLE pipe, std::wstring& msg, uint32_t max_count = UINT32_MAX,
+                 OVERLAPPED* ov = nullptr) {
+  const ULONGLONG deadline = ::GetTickCount64() + kPipeTimeoutMs;
+  uint32_t count;
+  DWORD read;
+  if (!PipeTransfer(pipe, false, reinterpret_cast<char*>(&count), sizeof(count),
+                    read, ov, deadline) || (read != sizeof(count)))
+    return false;
+  if (count > max_count)
+    return false;
+  msg.resize(count);
+  char* data = reinterpret_cast<char*>(&msg[0]);
+  size_t left = count * sizeof(wchar_t);
+  while (left) {
+    if (!PipeTransfer(pipe, false, data, static_cast<DWORD>(std::min<size_t>(left, 64 * 1024)),
+                      read, ov, deadline) || !read)
+      return false;
+    data += read;
+    left -= read;
+  }
+  return true;
+}
+
+// Fields of a message are separated by a null.
+std::vector<std::wstring> SplitMessage(const std::wstring& msg) {
+  std::vector<std::wstring> fields;
+  size_t start = 0;
+  for (size_t pos; (pos = msg.find(L'\0', start)) != std::wstring::npos; start = pos + 1)
+    fields.push_back(msg.substr(start, pos - start));
+  fields.push_back(msg.substr(start));
+  return fields;
+}
+
+// The security descriptor of the server pipe in SDDL: full access for the
+// user that runs the server and nobody else.
+std::wstring PipeSecurity() {
+  HANDLE token;
+  if (!::OpenProcessToken(::GetCurrentProcess(), TOKEN_QUERY, &token))
+    return std::wstring();
+  std::wstring sddl;
+  char buf[256];
+  DWORD size;
+  if (::GetTokenInformation(token, TokenUser, buf, sizeof(buf), &size)) {
+    wchar_t* sid;
+    if (::ConvertSidToStringSidW(reinterpret_cast<TOKEN_USER*>(buf)->User.Sid, &sid)) {
+      sddl = L"D:P(A;;GA;;;" + std::wstring(sid) + L")";
+      ::LocalFree(sid);
+    }
+  }
+  ::CloseHandle(token);
+  return sddl;
+}
+
+class PlexServer {
+  TokenCache* cache_;
+  std::unique_ptr<SharedCatalog> shared_;
+  std::wstring shared_index_;
+  // The input of the request being served, for its error report.
+  std::wstring input_;
+  bool stop_;
+
+public:
+  explicit PlexServer(TokenCache* cache) : cache_(cache), stop_(false) {
+  }
+
+  void Run(const std::wstring& pipe_name) {
+    // Function statics are initialized before any thread runs.
+    GetCharClassTable();
+    GetIdentifierWordTable();
+    GetPreprocessorWordTable();
+    RunArena();
+    Atoms::Get();
+
+    // Only local clients of the same user can connect, and the pipe must be
+    // ours: creating it fails if another process already has the name.
+    PSECURITY_DESCRIPTOR sd = nullptr;
+    auto sddl = PipeSecurity();
+    if (sddl.empty() || !::ConvertStringSecurityDescriptorToSecurityDescriptorW(
+            sddl.c_str(), SDDL_REVISION_1, &sd, nullptr))
+      throw IOException(__LINE__, pipe_name.c_str());
+    SECURITY_ATTRIBUTES sa = { sizeof(sa), sd, FALSE };
+
+    // The pipe is overlapped so that reading the request and writing the
+    // answer time out. A client that connects and then stalls is dropped
+    // after kPipeTimeoutMs instead of blocking every client behind it.
+    OVERLAPPED ov = {};
+    ov.hEvent = ::CreateEventW(nullptr, TRUE, FALSE, nullptr);
+    if (!ov.hEvent) {
+      ::LocalFree(sd);
+      throw IOException(__LINE__, pipe_name.c_str());
+    }
+
+    while (!stop_) {
+      HANDLE pipe = ::CreateNamedPipeW(pipe_name.c_str(),
+                                       PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE |
+                                       FILE_FLAG_OVERLAPPED,
+                                       PIPE_TYPE_BYTE | PIPE_READMODE_BYTE | PIPE_WAIT |
+                                       PIPE_REJECT_REMOTE_CLIENTS,
+                                       1, 64 * 1024, 64 * 1024, 0, &sa);
+      if (pipe == INVALID_HANDLE_VALUE) {
+        ::CloseHandle(ov.hEvent);
+        ::LocalFree(sd);
+        throw IOException(__LINE__, pipe_name.c_str());
+      }
+      if (Connect(pipe, &ov)) {
+        std::wstring request;
+        if (ReadMessage(pipe, request, kMaxRequest, &ov)) {
+          if (WriteMessage(pipe, Serve(SplitMessage(request)), &ov)) {
+            // Instead of FlushFileBuffers(), which waits for as long as the
+            // client does not read, wait for the client to close its end.
+            char unused;
+            DWORD read;
+            PipeTransfer(pipe, false, &unused, 1, read, &ov,
+                         ::GetTickCount64() + kPipeTimeoutMs);
+          }
+        }
+      }
+      ::DisconnectNamedPipe(pipe);
+      ::CloseHandle(pipe);
+    }
+    ::CloseHandle(ov.hEvent);
+    ::LocalFree(sd);
+  }
+
+private:
+  // Waits for a client on the overlapped |pipe|, with no deadline.
+  static bool Connect(HANDLE pipe, OVERLAPPED* ov) {
+    ::ResetEvent(ov->hEvent);
+    if (::ConnectNamedPipe(pipe, ov))
+      return true;
+    auto error = ::GetLastError();
+    if (error == ERROR_PIPE_CONNECTED)
+      return true;
+    if (error != ERROR_IO_PENDING)
+      return false;
+    DWORD unused;
+    return ::GetOverlappedResult(pipe, ov, &unused, TRUE) != 0;
+  }
+
+  // |request| is the client directory followed by its argv. Returns the exit
+  // code and the messages.
+  std::wstring Serve(const std::vector<std::wstring>& request) {
+    std::wstring report;
+    int code = 2;
+    input_.clear();
+    try {
+      code = Process(request, report);
+    } catch (PlexException&) {
+      report += FailureText(input_);
+    } catch (std::exception&) {
+      report += FailureText(input_);
+    }
+    // Only the catalog stays loaded between requests.
+    RunArena().Release();
+    UnloadFiles([this](const LoadedFile& lf) {
+      return shared_ && shared_->Uses(lf.id);
+    });
+    return std::to_wstring(code) + L'\0' + report;
+  }
+
+  int Process(const std::vector<std::wstring>& request, std::wstring& report) {
+    if ((request.size() < 2) || !::SetCurrentDirectoryW(request[0].c_str())) {
+      report = L"error: bad request\n";
+      return 1;
+    }
+    std::vector<wchar_t*> argv;
+    for (size_t ix = 1; ix != request.size(); ++ix)
+      argv.push_back(const_cast<wchar_t*>(request[ix].c_str()));
+    CmdLine cmdline(static_cast<int>(argv.size()), &argv[0]);
+
+    if (cmdline.HasSwitch("shutdown")) {
+      stop_ = true;
+      report = L"plex: server stopped\n";
+      return 0;
+    }
+
+    int op_mode = GetOpMode(cmdline);
+    if ((op_mode == None) || (op_mode & PCHGen) || cmdline.HasSwitch("depfile")) {
+      report = L"error: the server takes --generate and --dump-tree only\n";
+      return 1;
+    }
+    auto inputs = GetInputs(cmdline);
+    if (inputs.empty()) {
+      report = L"error: no input\n";
+      return 1;
+    }
+    input_ = inputs[0];
+    FilePath path(inputs[0]);
+    FilePath out_path(L"");
+    if (!GetOutputDir(cmdline, path, out_path)) {
+      report = L"unable to create output directory\n";
+      return 1;
+    }
+
+    wchar_t full[MAX_PATH];
+    auto index = GetCatalogIndex(cmdline, path);
+    if (!::GetFullPathNameW(index.Raw(), MAX_PATH, full, nullptr))
+      throw IOException(__LINE__, index.Raw());
+    FilePath catalog(full);
+    // The shared catalog was lexed with the defines of the previous request.
+    auto defines = GetDefines(cmdline);
+    if (defines != plex_defines) {
+      plex_defines = defines;
+      shared_.reset();
+    }
+    if (!shared_ || (shared_index_ != catalog.Raw()) || !shared_->IsCurrent()) {
+      shared_.reset();
+      UnloadFiles([](const LoadedFile&) { return false; });
+      shared_.reset(new SharedCatalog(catalog, cache_));
+      shared_index_ = catalog.Raw();
+    }
+
+    int jobs = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    if (cmdline.HasSwitch("jobs") && (atoi(cmdline.Value("jobs").c_str()) > 0))
+      jobs = atoi(cmdline.Value("jobs").c_str());
+    const bool incremental = cmdline.HasSwitch("incremental");
+    output_style = GetOutputStyle(cmdline);
+    const std::string options = std::to_string(op_mode) + " " + catalog.ToAscii() +
+                                " " + DefinesKey() + " " + std::to_string(output_style);
+    size_t entity_count = 0;
+    auto failures = RunBatch(inputs, *shared_, catalog,
+                             cmdline.Value("out-dir").empty() ? nullptr : &out_path,
+                             op_mode, incremental, options, cache_, jobs, entity_count,
+                             &report);
+    return failures ? 2 : 0;
+  }
+};
+
+// Sends the command line to the server and prints its answer. Returns the exit
+// code of the request.
+int RunClient(const std::wstring& pipe_name, int argc, wchar_t* argv[]) {
+  wchar_t cwd[MAX_PATH];
+  if (!::GetCurrentDirectoryW(MAX_PATH, cwd))
+    return 1;
+  std::wstring request(cwd);
+  for (int ix = 0; ix != argc; ++ix) {
+    std::wstring arg(argv[ix]);
+    if (arg.compare(0, 8, L"--client") == 0)
+      continue;
+    request += L'\0' + arg;
+  }
+
+  HANDLE pipe;
+  for (;;) {
+    pipe = ::CreateFileW(pipe_name.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr,
+                         OPEN_EXISTING, 0, nullptr);
+    if (pipe != INVALID_HANDLE_VALUE)
+      break;
+    if ((::GetLastError() != ERROR_PIPE_BUSY) || !::WaitNamedPipeW(pipe_name.c_str(), 10000)) {
+      wprintf(L"error: no plex server at [%s]\n", pipe_name.c_str());
+      return 1;
+    }
+  }
+
+  std::wstring answer;
+  bool ok = WriteMessage(pipe, request) && ReadMessage(pipe, answer);
+  ::CloseHandle(pipe);
+  if (!ok) {
+    wprintf(L"error: the plex server went away\n");
+    return 1;
+  }
+  auto fields = SplitMessage(answer);
+  if (fields.size() > 1)
+    fputws(fields[1].c_str(), stdout);
+  return _wtoi(fields[0].c_str());
+}
+
+#pragma endregion
+
+int wmain(int argc, wchar_t* argv[]) {
+  CmdLine cmdline(argc, argv);
+
+  if (cmdline.HasSwitch("compile-index")) {
+    auto inputs = GetInputs(cmdline);
+    FilePath catalog = GetCatalogIndex(
+        cmdline, FilePath(inputs.empty() ? std::wstring() : inputs[0]));
+    try {
+      FilePath log_path(L"plex_log.txt");
+      Logger logger(log_path);
+      auto index_tv = LoadLexedTokens(catalog, LexMode::PlexCPP, nullptr);
+      XternDefs xdefs;
+      ProcessCatalog(index_tv, xdefs);
+      auto compiled_path = CompiledIndex::PathFor(catalog);
+      auto count = WriteCompiledIndex(compiled_path, xdefs);
+      wprintf(L"plex: [%s] %d definitions\n", compiled_path.Raw(), static_cast<int>(count));
+      return 0;
+    } catch (PlexException&) {
+      ReportFailure(catalog.Raw());
+      return 2;
+    }
+  }
+
+  if (cmdline.HasSwitch("client"))
+    return RunClient(PipeName(cmdline.Value("client")), argc, argv);
+
+  if (cmdline.HasSwitch("serve")) {
+    try {
+      std::unique_ptr<TokenCache> token_cache;
+      auto tc = AsciiToUTF16(cmdline.Value("token-cache"));
+      if (!tc.empty())
+        token_cache.reset(new TokenCache(FilePath(tc)));
+      FilePath log_path(L"plex_log.txt");
+      Logger logger(log_path);
+      auto pipe_name = PipeName(cmdline.Value("serve"));
+      wprintf(L"plex: serving on [%s]\n", pipe_name.c_str());
+      PlexServer(token_cache.get()).Run(pipe_name);
+      return 0;
+    } catch (PlexException&) {
+      ReportFailure(L"<server>");
+      return 2;
+    }
+  }
+
+  int op_mode = GetOpMode(cmdline);
 
   if (op_mode == None) {
     printf("plex by carlos.pizano@gmail.com. Version " __DATE__ "\n");
-    wprintf(L"usage: plex.exe options cc_file\n");
+    wprintf(L"usage: plex.exe options cc_file [cc_file ...] [@response_file]\n");
     wprintf(L"options:  --dump-tree and|or --generate\n");
-    wprintf(L"          --pch --catalog=<path>\n");
-    wprintf(L"          --out-dir=<path>\n");
+    wprintf(L"          --pch [--prune] [--shards=<count>] --catalog=<path>\n");
+    wprintf(L"          --out-dir=<path> --define=<name>[=<value>][,...]\n");
+    wprintf(L"          --jobs=<count> --token-cache=<path> --tokenize-chunk=<bytes>\n");
+    wprintf(L"          --incremental --depfile=<path> --minify[=lines]\n");
+    wprintf(L"          --compile-index [--catalog=<path>]\n");
+    wprintf(L"          --stats[=json]\n");
+    wprintf(L"          --serve[=<name>] | --client[=<name>] [--shutdown]\n");
     return 0;
   }
 
   try {
-    // Input file, typically a c++ file. The catalog index is also an implicit input.
-    FilePath path(cmdline.Extra(0));
-
-    auto cv = AsciiToUTF16(cmdline.Value("catalog"));
-    FilePath catalog = cv.empty() ?
-        FilePath(path.Parent()).Append(L"catalog\\index.plex") :
-        FilePath(cv).Append(L"index.plex");
-
-    auto out_path_str = AsciiToUTF16(cmdline.Value("out-dir"));
-    if (!out_path_str.empty()) {
-      if (!::CreateDirectoryW(out_path_str.c_str(), NULL)) {
-        if (::GetLastError() != ERROR_ALREADY_EXISTS) {
-          wprintf(L"unable to create output directory\n");
-          return 1;
-        }
+    // Input files, typically c++ files. The catalog index is also an implicit input.
+    auto inputs = GetInputs(cmdline);
+    FilePath path(inputs.empty() ? std::wstring() : inputs[0]);
+
+    FilePath catalog = GetCatalogIndex(cmdline, path);
+
+    FilePath out_path(L"");
+    if (!GetOutputDir(cmdline, path, out_path)) {
+      wprintf(L"unable to create output directory\n");
+      return 1;
+    }
+
+    // Incremental mode: exit if the previous run had the same inputs.
+    const bool incremental = cmdline.HasSwitch("incremental");
+    const bool prune = cmdline.HasSwitch("prune");
+    int shards = 1;
+    if (cmdline.HasSwitch("shards"))
+      shards = std::max(1, atoi(cmdline.Value("shards").c_str()));
+    plex_defines = GetDefines(cmdline);
+    output_style = GetOutputStyle(cmdline);
+    const std::string options = std::to_string(op_mode) + " " + catalog.ToAscii() +
+                                (prune ? " prune" : "") + " " + std::to_string(shards) +
+                                " " + DefinesKey() + " " + std::to_string(output_style);
+
+    // Optional cache of the lexed catalog files.
+    std::unique_ptr<TokenCache> token_cache;
+    auto tc = AsciiToUTF16(cmdline.Value("token-cache"));
+    if (!tc.empty())
+      token_cache.reset(new TokenCache(FilePath(tc)));
+
+    int jobs = 1;
+    if (cmdline.HasSwitch("jobs")) {
+      jobs = atoi(cmdline.Value("jobs").c_str());
+      if (jobs <= 0)
+        jobs = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+    }
+    if (cmdline.HasSwitch("tokenize-chunk")) {
+      auto chunk = atoi(cmdline.Value("tokenize-chunk").c_str());
+      if (chunk > 0)
+        tokenize_chunk_size = chunk;
+    }
+
+    if (inputs.size() > 1) {
+      // Batch mode, all the inputs share the catalog.
+      if (op_mode & PCHGen) {
+        wprintf(L"error: --pch takes a single input\n");
+        return 1;
       }
-    } else {
-      out_path_str = path.Parent().Raw();
+      if (cmdline.HasSwitch("depfile")) {
+        wprintf(L"error: --depfile takes a single input\n");
+        return 1;
+      }
+      if (!cmdline.HasSwitch("jobs"))
+        jobs = std::max(1, static_cast<int>(std::thread::hardware_concurrency()));
+
+      Logger logger(path.Parent().Append(L"plex_log.txt"));
+      RunStats stats;
+      SharedCatalog shared(catalog, token_cache.get());
+      stats.EndPhase("catalog");
+
+      size_t entity_count = 0;
+      auto failures = RunBatch(inputs, shared, catalog,
+                               cmdline.Value("out-dir").empty() ? nullptr : &out_path,
+                               op_mode, incremental, options, token_cache.get(), jobs,
+                               entity_count);
+      stats.EndPhase("units");
+      ReportStats(cmdline, stats, entity_count);
+
+      RunArena().Release();
+      logger.AddArenaStats(RunArena().GetStats());
+      return failures ? 2 : 0;
+    }
+
+    RunStats stats;
+    FilePath manifest_path = out_path.Append(
+        ((op_mode & PCHGen) ? std::wstring(L"stdafx") : path.Leaf()) + L".plexmf");
+    if (incremental && Manifest::IsCurrent(manifest_path, options)) {
+      wprintf(L"plex: [%s] is up to date\n", path.Raw());
+      stats.EndPhase("manifest");
+      ReportStats(cmdline, stats, 0);
+      return 0;
     }
+    std::vector<std::wstring> outputs;
 
-    FilePath out_path(out_path_str);
     Logger logger(path.Parent().Append(L"plex_log.txt"));
 
     // Phase 1 : process the input cc.
-    CppTokenVector cc_tv = TokenizeCpp(path);
-    LexCppTokens(LexMode::PlainCPP, cc_tv);
+    CppTokenVector cc_tv = TokenizeAndLexCpp(path, LexMode::PlainCPP, nullptr, jobs);
+    stats.EndPhase("tokenize");
 
     // Phase 2 : process the catalog.
-    CppTokenVector index_tv = TokenizeCpp(catalog);
-    LexCppTokens(LexMode::PlexCPP, index_tv);
-    XternDefs xdefs;
-    ProcessCatalog(index_tv, xdefs);
+    CppTokenVector index_tv;
+    CompiledIndex compiled;
+    XternDefs xdefs(compiled.Open(catalog) ? &compiled : nullptr);
+    if (!xdefs.IsCompiled()) {
+      index_tv = LoadLexedTokens(catalog, LexMode::PlexCPP, token_cache.get());
+      ProcessCatalog(index_tv, xdefs);
+    }
+    stats.EndPhase("catalog");
 
     // Phase 3: find and resolve the needed catalog entities.
     GetExternalDefinitions(cc_tv, xdefs);
-    XEntities entities = 
-        LoadEntities(xdefs, catalog.Parent());
+    XEntities entities = (jobs > 1) ?
+        LoadEntitiesParallel(xdefs, catalog.Parent(), token_cache.get(), jobs) :
+        LoadEntities(xdefs, catalog.Parent(), token_cache.get());
     entities.Dedup_Includes();
+    stats.EndPhase("resolve");
 
     // Phase 4: process each entity augmenting the source.
     CppTokenVector* target_tv = nullptr;
     if (op_mode & PCHGen) {
       // PCH mode.
-      auto pch_h_tv = TokenizeCpp(catalog.Parent().Append(L"stdafx.h"));
-      LexCppTokens(LexMode::PlexCPP, pch_h_tv);
-
-      auto pch_cc_tv = TokenizeCpp(catalog.Parent().Append(L"stdafx.cpp"));
-      LexCppTokens(LexMode::PlexCPP, pch_cc_tv);
+      auto pch_h_tv = TokenizeAndLexCpp(catalog.Parent().Append(L"stdafx.h"), LexMode::PlexCPP);
+      // Each shard is a copy of the stdafx.cpp template.
+      std::vector<CppTokenVector> pch_cc_tvs;
+      for (int ix = 0; ix != shards; ++ix) {
+        pch_cc_tvs.push_back(
+            TokenizeAndLexCpp(catalog.Parent().Append(L"stdafx.cpp"), LexMode::PlexCPP));
+      }
 
-      ProcessEntities2(pch_h_tv, pch_cc_tv, entities);
+      ProcessEntities2(pch_h_tv, pch_cc_tvs, entities, prune ? &cc_tv : nullptr);
+      stats.EndPhase("process");
 
       if (op_mode & Generate) {
-        File output_cc = MakeOutputCodeFile(out_path, L"stdafx.cpp");
-        WriteOutputFile(output_cc, pch_cc_tv);
-
-        File output_h = MakeOutputCodeFile(out_path, L"stdafx.h");
-        WriteOutputFile(output_h, pch_h_tv);
+        for (int ix = 0; ix != shards; ++ix) {
+          auto name = ix ? L"stdafx_" + std::to_wstring(ix) + L".cpp" : std::wstring(L"stdafx.cpp");
+          WriteGeneratedFile(out_path, name, pch_cc_tvs[ix], incremental, outputs);
+        }
+        WriteGeneratedFile(out_path, L"stdafx.h", pch_h_tv, incremental, outputs);
       }
 
       if (op_mode & TreeDump) {  
@@ -2937,44 +6867,36 @@ int wmain(int argc, wchar_t* argv[]) {
     } else {
       // Old mode.
       ProcessEntities(cc_tv, entities);
+      stats.EndPhase("process");
 
-      if (op_mode & Generate) {
-        File output_cc = MakeOutputCodeFile(out_path, path.Leaf());
-        WriteOutputFile(output_cc, cc_tv);
-      }
-
-      if (op_mode & TreeDump) {  
-        File test_dump = MakeTestDumpFile(out_path, path.Leaf());
-        GenerateDump(test_dump, cc_tv);
-      }
+      WriteUnitOutputs(out_path, path, cc_tv, op_mode, incremental, outputs);
     }
 
-    return 0;
-
-  } catch (TokenizerException& ex) {
-    wprintf(L"\nerror: [%s] Tokenizer error\n"
-            L"in source line %d file [%s]\n"
-            L"in program line %d, version (%S)\n",
-            cmdline.Extra(0).c_str(),
-            ex.SourceLine(), ex.Path(),
-            ex.Line(), __DATE__);
+    auto depfile = AsciiToUTF16(cmdline.Value("depfile"));
+    // The inputs are every file this run read. A compiled index stands for
+    // index.plex, which is then not read but can make the compiled index stale.
+    if (xdefs.IsCompiled() && (incremental || !depfile.empty()))
+      LoadFileOnce(catalog);
 
-    if (Logger::HasLogger())
-      Logger::Get().ReportException(ex);
-  
-  } catch (IOException& ex) {
-    wprintf(L"error: can't open file [%s] (line %d)\n", ex.Name(), ex.Line());
+    if (incremental)
+      Manifest::Write(manifest_path, options, LoadedFiles(), outputs);
 
-    if (Logger::HasLogger())
-      Logger::Get().ReportException(ex);
+    if (!depfile.empty()) {
+      std::vector<std::wstring> inputs;
+      for (auto& lf : LoadedFiles())
+        inputs.push_back(lf.path);
+      WriteDepfile(FilePath(depfile), outputs, inputs);
+    }
+    stats.EndPhase("write");
+    ReportStats(cmdline, stats, entities.code.size() + entities.includes.size());
 
-  } catch (PlexException& ex) {
-    wprintf(L"\nerror: [%s] fatal exception [%S]\n"
-            L"in program line %d, version (%S)\n",
-            cmdline.Extra(0).c_str(), ex.Message(), ex.Line(), __DATE__);
+    // The parse structures are released in one go.
+    RunArena().Release();
+    logger.AddArenaStats(RunArena().GetStats());
+    return 0;
 
-    if (Logger::HasLogger())
-      Logger::Get().ReportException(ex);
+  } catch (PlexException&) {
+    ReportFailure(cmdline.Extra(0));
   }
 
   return 2;